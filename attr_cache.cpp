@@ -0,0 +1,164 @@
+/*
+  Copyright (c) 2012 Rohan McGovern <rohan@mcgovern.id.au>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+  LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <string.h>
+#include <time.h>
+
+#include "attr_cache.h"
+#include "shared.h"
+
+static uint64_t now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+AttrCache::AttrCache()
+  : _ttl(0)
+{
+}
+
+void AttrCache::start(double ttl)
+{
+  if (ttl > 0) {
+    _ttl = ttl * 1e9;
+    std::vector<Set>(SETS).swap(_sets);
+  }
+}
+
+bool AttrCache::lookup(const char* path, struct stat* st, int* error,
+		       uint64_t* generation)
+{
+  if (!enabled()) {
+    return false;
+  }
+
+  uint64_t h = hash_path(path, strlen(path));
+  Set& s = set(h);
+  std::lock_guard<std::mutex> lock(s.mutex);
+  *generation = s.generation;
+  for (Entry& entry : s.entries) {
+    if (entry.hash == h && entry.expires && entry.path == path) {
+      if (entry.expires < now()) {
+	entry.expires = 0;
+	return false;
+      }
+      *error = entry.error;
+      if (!entry.error) {
+	*st = entry.st;
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
+void AttrCache::insert(const char* path, const struct stat* st, int error,
+		       uint64_t generation)
+{
+  if (!enabled()) {
+    return;
+  }
+
+  uint64_t h = hash_path(path, strlen(path));
+  uint64_t time = now();
+  Set& s = set(h);
+  std::lock_guard<std::mutex> lock(s.mutex);
+  if (s.generation != generation) {
+    return;
+  }
+
+  /* replace the same path, else an unused entry, else the oldest */
+  Entry* victim = &s.entries[0];
+  for (Entry& entry : s.entries) {
+    if (entry.hash == h && entry.path == path) {
+      victim = &entry;
+      break;
+    }
+    if (entry.expires < victim->expires) {
+      victim = &entry;
+    }
+  }
+
+  victim->hash = h;
+  victim->expires = time + _ttl;
+  victim->error = error;
+  if (!error) {
+    victim->st = *st;
+  }
+  victim->path = path;
+}
+
+void AttrCache::forget(const char* path, size_t length)
+{
+  uint64_t h = hash_path(path, length);
+  Set& s = set(h);
+  std::lock_guard<std::mutex> lock(s.mutex);
+  ++s.generation;
+  for (Entry& entry : s.entries) {
+    if (entry.hash == h && entry.path.length() == length
+	&& !memcmp(entry.path.data(), path, length)) {
+      entry.expires = 0;
+    }
+  }
+}
+
+void AttrCache::invalidate(const char* path)
+{
+  /* path is null for writes to a file unlinked while open */
+  if (!enabled() || !path) {
+    return;
+  }
+
+  size_t length = strlen(path);
+  forget(path, length);
+
+  const char* slash = strrchr(path, '/');
+  if (slash) {
+    forget(path, slash == path ? 1 : slash - path);
+  }
+}
+
+void AttrCache::invalidate_tree(const char* path)
+{
+  if (!enabled()) {
+    return;
+  }
+
+  invalidate(path);
+
+  /* renames of directories are rare enough to scan the whole cache for */
+  size_t length = strlen(path);
+  for (Set& s : _sets) {
+    std::lock_guard<std::mutex> lock(s.mutex);
+    ++s.generation;
+    for (Entry& entry : s.entries) {
+      if (entry.expires && entry.path.length() > length
+	  && entry.path[length] == '/'
+	  && !entry.path.compare(0, length, path)) {
+	entry.expires = 0;
+      }
+    }
+  }
+}
@@ -0,0 +1,105 @@
+#ifndef SANDBOX_ATTR_CACHE_H
+#define SANDBOX_ATTR_CACHE_H
+
+
+/*
+  Copyright (c) 2012 Rohan McGovern <rohan@mcgovern.id.au>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+  LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+/*
+  Cache of lstat() results by path for the FUSE process, including
+  negative (ENOENT) results, which build systems produce in bulk when
+  probing include paths.
+
+  The cache is a fixed number of small sets, each with its own lock, so
+  its size is bounded and threads rarely contend. A lookup hashes the path
+  and compares it with at most a few entries, and never allocates.
+  Entries expire after a time-to-live to pick up changes made outside of
+  the sandbox; changes made through the sandbox invalidate them at once.
+*/
+class AttrCache {
+ public:
+  AttrCache();
+
+  /* start caching for ttl seconds; a cache never started does nothing */
+  void start(double ttl);
+  bool enabled() const { return !_sets.empty(); }
+
+  /*
+    If path is cached, set *st (if the entry is positive) and *error (0 or
+    a negative errno) and return true. Else set *generation, to be passed
+    to insert() with the result of an lstat() made after this call.
+  */
+  bool lookup(const char* path, struct stat* st, int* error,
+	      uint64_t* generation);
+
+  /*
+    Cache the result of lstat(path): st if error is 0, else -ENOENT. The
+    result is dropped if path may have been invalidated since the lookup()
+    which gave generation, as it may predate the change.
+  */
+  void insert(const char* path, const struct stat* st, int error,
+	      uint64_t generation);
+
+  /* forget path, and its parent directory, whose times and links change */
+  void invalidate(const char* path);
+
+  /* forget path, its parent, and everything below path */
+  void invalidate_tree(const char* path);
+
+ private:
+  enum {
+    WAYS = 4,
+    SETS = 8192
+  };
+
+  struct Entry {
+    uint64_t hash;
+    uint64_t expires;  /* CLOCK_MONOTONIC ns; 0 if the entry is unused */
+    int error;
+    struct stat st;
+    std::string path;
+  };
+
+  struct Set {
+    std::mutex mutex;
+    uint64_t generation;  /* bumped whenever an entry is invalidated */
+    Entry entries[WAYS];
+
+    Set() : generation(0) {}
+  };
+
+  Set& set(uint64_t hash) { return _sets[hash % _sets.size()]; }
+  void forget(const char* path, size_t length);
+
+  uint64_t _ttl;
+  std::vector<Set> _sets;
+};
+
+#endif
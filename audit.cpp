@@ -0,0 +1,291 @@
+/*
+  Copyright (c) 2012 Rohan McGovern <rohan@mcgovern.id.au>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+  LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "audit.h"
+#include "shared.h"
+#include "stats.h"
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+/* bytes in each thread's ring */
+#define AUDIT_RING_SIZE (64 << 10)
+
+/* most milliseconds between drains of the rings */
+#define AUDIT_INTERVAL_MS 100
+
+/* Record::op of the filler before a ring wraps */
+#define AUDIT_SKIP 0xffff
+
+/* a record in a ring, followed by its path, padded to 8 bytes */
+struct Record {
+  uint64_t nanoseconds;   /* CLOCK_REALTIME */
+  int32_t pid;
+  int32_t result;
+  uint16_t op;
+  uint16_t length;
+};
+
+/*
+  Records are only written by the owning thread and only read by whoever
+  holds rings_mutex, so head and tail order all access. Both count bytes
+  from the start; a record which won't fit before the end of data is
+  preceded by filler up to the end.
+*/
+struct Ring {
+  std::atomic<uint64_t> head;
+  std::atomic<uint64_t> tail;
+  std::atomic<uint64_t> dropped;
+  std::atomic<bool> closed;   /* owning thread has exited */
+  uint64_t dropped_written;
+  char data[AUDIT_RING_SIZE];
+
+  Ring() : head(0), tail(0), dropped(0), closed(false), dropped_written(0) {}
+};
+
+int audit_enabled = 0;
+
+static int audit_fd = -1;
+static int wake_fd = -1;  /* wakes the writer when a ring is half full */
+static std::atomic<bool> stopping(false);  /* the writer should return */
+static std::thread writer;
+static std::mutex rings_mutex;
+static std::vector<Ring*> rings;
+static thread_local Ring* thread_ring;
+
+/* marks the thread's ring for deletion, once drained, when the thread exits */
+static thread_local struct RingOwner {
+  ~RingOwner()
+  {
+    if (thread_ring) {
+      thread_ring->closed.store(true, std::memory_order_release);
+    }
+  }
+} ring_owner;
+
+static inline size_t record_size(size_t length)
+{
+  return (sizeof(Record) + length + 7) & ~size_t(7);
+}
+
+void audit_record(int op, const char* path, pid_t pid, int result)
+{
+  if (!thread_ring) {
+    (void)&ring_owner;
+    Ring* ring = new Ring();
+    std::lock_guard<std::mutex> lock(rings_mutex);
+    rings.push_back(ring);
+    thread_ring = ring;
+  }
+  Ring* ring = thread_ring;
+
+  size_t length = strlen(path);
+  if (length > 0xfff0) {
+    length = 0xfff0;
+  }
+  size_t size = record_size(length);
+  uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+  uint64_t head = ring->head.load(std::memory_order_acquire);
+  size_t pos = tail % AUDIT_RING_SIZE;
+  size_t skip = AUDIT_RING_SIZE - pos < size ? AUDIT_RING_SIZE - pos : 0;
+  if (AUDIT_RING_SIZE - (tail - head) < skip + size) {
+    ring->dropped.store(ring->dropped.load(std::memory_order_relaxed) + 1,
+			std::memory_order_relaxed);
+    return;
+  }
+  if (skip) {
+    /* too little room for a record header is skipped without one */
+    if (skip >= sizeof(Record)) {
+      reinterpret_cast<Record*>(ring->data + pos)->op = AUDIT_SKIP;
+    }
+    tail += skip;
+    pos = 0;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  Record* record = reinterpret_cast<Record*>(ring->data + pos);
+  record->nanoseconds = now.tv_sec * 1000000000ULL + now.tv_nsec;
+  record->pid = pid;
+  record->result = result;
+  record->op = op;
+  record->length = length;
+  memcpy(record + 1, path, length);
+  ring->tail.store(tail + size, std::memory_order_release);
+
+  if (tail - head < AUDIT_RING_SIZE / 2
+      && tail + size - head >= AUDIT_RING_SIZE / 2) {
+    uint64_t one = 1;
+    write(wake_fd, &one, sizeof(one));
+  }
+}
+
+static void write_time(FILE* out, uint64_t nanoseconds)
+{
+  fprintf(out, "{\"time\": %llu.%09llu",
+	  (unsigned long long)(nanoseconds / 1000000000ULL),
+	  (unsigned long long)(nanoseconds % 1000000000ULL));
+}
+
+/* write the ring's records to out, as JSON lines, and empty it */
+static void drain(Ring* ring, FILE* out)
+{
+  uint64_t head = ring->head.load(std::memory_order_relaxed);
+  uint64_t tail = ring->tail.load(std::memory_order_acquire);
+  while (head != tail) {
+    size_t pos = head % AUDIT_RING_SIZE;
+    size_t left = AUDIT_RING_SIZE - pos;
+    const Record* record = reinterpret_cast<const Record*>(ring->data + pos);
+    if (left < sizeof(Record) || record->op == AUDIT_SKIP) {
+      head += left;
+      continue;
+    }
+
+    write_time(out, record->nanoseconds);
+    fprintf(out, ", \"op\": \"%s\", \"path\": ", stats_op_name(record->op));
+    write_json_string(out, std::string(reinterpret_cast<const char*>(record + 1),
+				       record->length));
+    fprintf(out, ", \"pid\": %d, \"result\": %d", record->pid,
+	    record->result);
+    if (record->result) {
+      fprintf(out, ", \"error\": ");
+      write_json_string(out, strerror(-record->result));
+    }
+    fprintf(out, "}\n");
+    head += record_size(record->length);
+  }
+  ring->head.store(head, std::memory_order_release);
+
+  uint64_t dropped = ring->dropped.load(std::memory_order_relaxed);
+  if (dropped != ring->dropped_written) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    write_time(out, now.tv_sec * 1000000000ULL + now.tv_nsec);
+    fprintf(out, ", \"dropped\": %llu}\n",
+	    (unsigned long long)(dropped - ring->dropped_written));
+    ring->dropped_written = dropped;
+  }
+}
+
+void audit_flush()
+{
+  std::lock_guard<std::mutex> lock(rings_mutex);
+
+  char* buf = 0;
+  size_t size = 0;
+  FILE* out = open_memstream(&buf, &size);
+  if (!out) {
+    return;
+  }
+  for (auto it = rings.begin(); it != rings.end(); ) {
+    Ring* ring = *it;
+    bool closed = ring->closed.load(std::memory_order_acquire);
+    drain(ring, out);
+    if (closed) {
+      delete ring;
+      it = rings.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  fclose(out);
+
+  /* one write of whole lines, so sandboxes may share a log */
+  size_t written = 0;
+  while (written < size) {
+    ssize_t result = write(audit_fd, buf + written, size - written);
+    if (result == -1) {
+      if (errno == EINTR) {
+	continue;
+      }
+      static bool reported = false;
+      if (!reported) {
+	perror("fs-audit: write");
+	reported = true;
+      }
+      break;
+    }
+    written += result;
+  }
+  free(buf);
+}
+
+static void write_periodically()
+{
+  struct pollfd pfd;
+  pfd.fd = wake_fd;
+  pfd.events = POLLIN;
+  for (;;) {
+    if (poll(&pfd, 1, AUDIT_INTERVAL_MS) > 0) {
+      uint64_t count;
+      read(wake_fd, &count, sizeof(count));
+    }
+    if (stopping.load(std::memory_order_acquire)) {
+      return;
+    }
+    audit_flush();
+  }
+}
+
+/* at exit, stop the writer before the rings go away, then write the rest */
+static void audit_stop()
+{
+  stopping.store(true, std::memory_order_release);
+  uint64_t one = 1;
+  write(wake_fd, &one, sizeof(one));
+  writer.join();
+  audit_flush();
+}
+
+int audit_start(const char* file, bool allowed)
+{
+  audit_fd = open(file, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0644);
+  if (audit_fd == -1) {
+    fprintf(stderr, "fs-audit: open %s: %s\n", file, strerror(errno));
+    return -1;
+  }
+  wake_fd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+  if (wake_fd == -1) {
+    perror("fs-audit: eventfd");
+    close(audit_fd);
+    return -1;
+  }
+  audit_enabled = AUDIT_DENIED | (allowed ? AUDIT_ALLOWED : 0);
+  writer = std::thread(write_periodically);
+  atexit(audit_stop);
+  return 0;
+}
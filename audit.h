@@ -0,0 +1,63 @@
+#ifndef SANDBOX_AUDIT_H
+#define SANDBOX_AUDIT_H
+
+
+/*
+  Copyright (c) 2012 Rohan McGovern <rohan@mcgovern.id.au>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+  LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <sys/types.h>
+
+/*
+  Audit log of writes checked by the FUSE process (--fs-audit).
+
+  Each thread appends records to its own lock-free ring, so recording one
+  costs a clock read and a copy of the path; a background thread drains
+  the rings and appends them to the log as one JSON object per line. If a
+  ring fills faster than it's drained, records are dropped and counted.
+*/
+
+#define AUDIT_DENIED 1
+#define AUDIT_ALLOWED 2
+
+/* which writes are being audited: AUDIT_DENIED and maybe AUDIT_ALLOWED */
+extern int audit_enabled;
+
+/*
+  Start appending records of denied writes, and of allowed writes too if
+  allowed is set, to file. Returns -1 if file can't be opened.
+*/
+int audit_start(const char* file, bool allowed);
+
+/* true if a write check with this result (0 or -errno) is recorded */
+static inline bool audit_wanted(int result)
+{
+  return audit_enabled & (result ? AUDIT_DENIED : AUDIT_ALLOWED);
+}
+
+/* record a check of operation op (a StatsOp) on path, by process pid */
+void audit_record(int op, const char* path, pid_t pid, int result);
+
+/* write out all records so far */
+void audit_flush();
+
+#endif
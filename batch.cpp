@@ -0,0 +1,234 @@
+/*
+  Copyright (c) 2012 Rohan McGovern <rohan@mcgovern.id.au>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+  LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "batch.h"
+#include "shared.h"
+
+namespace {
+
+struct Result {
+  int status;
+  double start;
+  double seconds;
+};
+
+volatile sig_atomic_t stopping = 0;
+
+void stop(int)
+{
+  stopping = 1;
+}
+
+double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+pid_t start_command(const std::string& command)
+{
+  pid_t pid = fork();
+  if (pid) {
+    if (pid == -1) {
+      perror("batch: fork");
+    }
+    return pid;
+  }
+
+  signal(SIGINT, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+  int null = open("/dev/null", O_RDONLY);
+  if (null == -1 || dup2(null, 0) == -1) {
+    perror("batch: /dev/null");
+    _exit(255);
+  }
+  if (null != 0) {
+    close(null);
+  }
+  execl("/bin/sh", "sh", "-c", command.c_str(), (char*)0);
+  perror("batch: /bin/sh");
+  _exit(255);
+}
+
+void write_report(FILE* out, const std::vector<std::string>& commands,
+		  const std::vector<Result>& results, double seconds)
+{
+  int failed = 0;
+  fprintf(out, "{\"commands\": [");
+  for (size_t i = 0; i < commands.size(); ++i) {
+    const Result& result = results[i];
+    fprintf(out, "%s\n  {\"command\": ", i ? "," : "");
+    write_json_string(out, commands[i]);
+    if (result.status == -1) {
+      fprintf(out, ", \"started\": false}");
+      ++failed;
+      continue;
+    }
+    if (WIFSIGNALED(result.status)) {
+      fprintf(out, ", \"signal\": %d", WTERMSIG(result.status));
+    } else {
+      fprintf(out, ", \"exit_status\": %d", WEXITSTATUS(result.status));
+    }
+    fprintf(out, ", \"start\": %.6f, \"seconds\": %.6f}",
+	    result.start, result.seconds);
+    if (result.status) {
+      ++failed;
+    }
+  }
+  fprintf(out, "\n], \"failed\": %d, \"seconds\": %.6f}\n", failed, seconds);
+}
+
+}
+
+void read_batch(Context* ctx, const char* file)
+{
+  FILE* in = strcmp(file, "-") ? fopen(file, "r") : stdin;
+  if (!in) {
+    fprintf(stderr, "Could not open %s: %s\n", file, strerror(errno));
+    exit(4);
+  }
+
+  char* line = 0;
+  size_t size = 0;
+  ssize_t length;
+  while ((length = getline(&line, &size, in)) != -1) {
+    while (length && (line[length-1] == '\n' || line[length-1] == '\r')) {
+      line[--length] = 0;
+    }
+    const char* command = line + strspn(line, " \t");
+    if (*command && *command != '#') {
+      ctx->batch_commands.push_back(command);
+    }
+  }
+  if (ferror(in)) {
+    fprintf(stderr, "Could not read %s: %s\n", file, strerror(errno));
+    exit(4);
+  }
+  free(line);
+  if (in != stdin) {
+    fclose(in);
+  }
+}
+
+int run_batch(const Context* ctx)
+{
+  const std::vector<std::string>& commands = ctx->batch_commands;
+  std::vector<Result> results(commands.size(), Result{-1, 0, 0});
+  std::map<pid_t, size_t> running;
+
+  /*
+    Stop starting commands on SIGINT or SIGTERM; those already running get
+    the signal too when it comes from the terminal. As pid 1 of a pid
+    namespace, this process would otherwise ignore them.
+  */
+  signal(SIGINT, stop);
+  signal(SIGTERM, stop);
+
+  double started = now();
+  size_t next = 0;
+  while (running.size() || (next < commands.size() && !stopping)) {
+    while (next < commands.size() && !stopping
+	   && (int)running.size() < ctx->batch_jobs) {
+      debug("batch: starting %s\n", commands[next].c_str());
+      pid_t pid = start_command(commands[next]);
+      if (pid == -1) {
+	stopping = 1;
+	break;
+      }
+      results[next].start = now() - started;
+      running[pid] = next++;
+    }
+    if (running.empty()) {
+      break;
+    }
+
+    /*
+      Reap any child: as pid 1 of a pid namespace, processes orphaned by
+      the commands are reparented here.
+    */
+    int status;
+    pid_t pid = wait(&status);
+    if (pid == -1) {
+      if (errno == EINTR) {
+	continue;
+      }
+      perror("batch: wait");
+      return 255;
+    }
+    auto it = running.find(pid);
+    if (it == running.end()) {
+      continue;
+    }
+    Result& result = results[it->second];
+    result.status = status;
+    result.seconds = now() - started - result.start;
+    debug("batch: %s: status 0x%x\n", commands[it->second].c_str(), status);
+    if (status && ctx->batch_report_fd == -1) {
+      fprintf(stderr, "rsandbox: batch: %s: %s %d\n",
+	      commands[it->second].c_str(),
+	      WIFSIGNALED(status) ? "killed by signal" : "exited with status",
+	      WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status));
+    }
+    running.erase(it);
+  }
+
+  int failed = 0;
+  for (const Result& result : results) {
+    if (result.status) {
+      ++failed;
+    }
+  }
+
+  if (ctx->batch_report_fd != -1) {
+    FILE* out = fdopen(ctx->batch_report_fd, "w");
+    if (!out) {
+      perror("batch: report");
+      return 255;
+    }
+    write_report(out, commands, results, now() - started);
+    if (fclose(out)) {
+      perror("batch: report");
+      return 255;
+    }
+  } else if (failed) {
+    fprintf(stderr, "rsandbox: batch: %d of %zu commands failed\n",
+	    failed, commands.size());
+  }
+
+  return failed ? 1 : 0;
+}
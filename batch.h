@@ -0,0 +1,45 @@
+#ifndef SANDBOX_BATCH_H
+#define SANDBOX_BATCH_H
+
+
+/*
+  Copyright (c) 2012 Rohan McGovern <rohan@mcgovern.id.au>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+  LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+struct Context;
+
+/*
+  --batch: read commands, one per line, from FILE ("-" for stdin) into
+  ctx->batch_commands. Blank lines and lines starting with # are skipped.
+  Exits on error.
+*/
+void read_batch(Context* ctx, const char* file);
+
+/*
+  Called in the sandbox in place of the command: run each of
+  ctx->batch_commands with `sh -c', up to ctx->batch_jobs at once, and
+  write a report to ctx->batch_report_fd if set. Returns 0 if all the
+  commands succeeded, otherwise 1.
+*/
+int run_batch(const Context* ctx);
+
+#endif
@@ -0,0 +1,200 @@
+#!/bin/sh
+#
+# Benchmark filesystem-heavy workloads natively and under rsandbox, to
+# measure the overhead of the sandbox.
+#
+# Usage: bench.sh [path/to/rsandbox]
+#
+# Results are written to stdout (or $BENCH_OUTPUT) as one JSON object per
+# line, for example:
+#
+#   {"workload": "stat", "mode": "fs", "run": 1, "seconds": 0.532, ...}
+#
+# Environment:
+#
+#   BENCH_MODES     modes to run, from: native no-fs fs (default: all)
+#   BENCH_WORKLOADS workloads to run (default: all; see WORKLOADS below)
+#   BENCH_REPEAT    runs of each workload in each mode (default: 3)
+#   BENCH_SCALE     multiplier for the size of generated data (default: 1)
+#   BENCH_DIR       directory for generated data (default: a new temporary
+#                   directory, removed afterwards)
+#   BENCH_OPTS      extra rsandbox options for the fs mode, e.g.
+#                   "--fs-engine=inode"
+#   BENCH_OUTPUT    file to append results to (default: stdout)
+#
+# rsandbox needs its capabilities set (see `make setcaps') or must be run
+# as root for the no-fs and fs modes.
+#
+
+set -e
+
+RSANDBOX=${1:-rsandbox}
+MODES=${BENCH_MODES:-native no-fs fs}
+WORKLOADS_ALL="stat small-read seq-read seq-write create-delete readdir compile"
+WORKLOADS=${BENCH_WORKLOADS:-$WORKLOADS_ALL}
+REPEAT=${BENCH_REPEAT:-3}
+SCALE=${BENCH_SCALE:-1}
+OPTS=${BENCH_OPTS:-}
+CC=${CC:-cc}
+JOBS=$(getconf _NPROCESSORS_ONLN 2>/dev/null || echo 4)
+
+if test -n "$BENCH_DIR"; then
+  DIR=$BENCH_DIR
+  mkdir -p "$DIR"
+else
+  DIR=$(mktemp -d "${TMPDIR:-/tmp}/rsandbox-bench.XXXXXX")
+  trap 'rm -rf "$DIR"' EXIT
+fi
+DIR=$(cd "$DIR" && pwd)
+
+if test -n "$BENCH_OUTPUT"; then
+  exec >>"$BENCH_OUTPUT"
+fi
+
+log() {
+  echo "bench: $*" >&2
+}
+
+# tree of $1 directories of $2 small files each, at depth 4
+make_tree() {
+  tree=$1
+  test -d "$tree" && return
+  log "generating $tree"
+  d=0
+  while test $d -lt "$3"; do
+    sub="$tree/a$((d % 4))/b$((d % 7))/c$d"
+    mkdir -p "$sub"
+    (cd "$sub" && seq -f "file%g.txt" 1 "$2" | xargs -n 200 sh -c \
+      'for f; do echo "contents of $f" > "$f"; done' sh)
+    d=$((d + 1))
+  done
+}
+
+setup() {
+  make_tree "$DIR/tree" 50 $((200 * SCALE))
+
+  if ! test -f "$DIR/big"; then
+    log "generating $DIR/big"
+    dd if=/dev/urandom of="$DIR/big" bs=1M count=$((256 * SCALE)) \
+      2>/dev/null
+  fi
+
+  if ! test -d "$DIR/bigdir"; then
+    log "generating $DIR/bigdir"
+    mkdir "$DIR/bigdir"
+    (cd "$DIR/bigdir" && seq -f "entry%g" 1 $((100000 * SCALE)) \
+      | xargs touch)
+  fi
+
+  if ! test -d "$DIR/compile"; then
+    log "generating $DIR/compile"
+    mkdir -p "$DIR/compile/include"
+    i=0
+    while test $i -lt 50; do
+      printf '#define VALUE_%d %d\nint header_%d(int);\n' $i $i $i \
+	> "$DIR/compile/include/h$i.h"
+      i=$((i + 1))
+    done
+    {
+      printf 'OBJS='
+      i=0
+      while test $i -lt $((200 * SCALE)); do
+	printf ' u%d.o' $i
+	{
+	  j=0
+	  while test $j -lt 50; do
+	    printf '#include "h%d.h"\n' $j
+	    j=$((j + 1))
+	  done
+	  printf 'int unit_%d(int x) { return x + VALUE_%d; }\n' $i $((i % 50))
+	} > "$DIR/compile/u$i.c"
+	i=$((i + 1))
+      done
+      printf '\nall: $(OBJS)\n'
+      printf '%%.o: %%.c\n\t$(CC) -Iinclude -O0 -c $< -o $@\n'
+      printf 'clean:\n\trm -f $(OBJS)\n'
+    } > "$DIR/compile/Makefile"
+  fi
+}
+
+# shell command for each workload; run with the data directory as cwd
+workload_command() {
+  case "$1" in
+  stat)
+    echo 'for i in 1 2 3; do ls -lRU tree > /dev/null; done' ;;
+  small-read)
+    echo 'find tree -type f -exec cat {} + > /dev/null' ;;
+  seq-read)
+    echo 'dd if=big of=/dev/null bs=1M 2>/dev/null' ;;
+  seq-write)
+    echo "dd if=/dev/zero of=out bs=1M count=$((256 * SCALE)) conv=fsync 2>/dev/null && rm -f out" ;;
+  create-delete)
+    echo "mkdir -p churn && cd churn && seq -f f%g 1 $((20000 * SCALE)) | xargs touch && seq -f f%g 1 $((20000 * SCALE)) | xargs rm -f && cd .. && rmdir churn" ;;
+  readdir)
+    echo 'for i in 1 2 3 4 5; do ls -f bigdir > /dev/null; done' ;;
+  compile)
+    echo "make -s -C compile clean && make -s -C compile -j$JOBS CC=$CC" ;;
+  *)
+    log "unknown workload $1"
+    exit 2 ;;
+  esac
+}
+
+now() {
+  date +%s%N
+}
+
+run_one() {
+  mode=$1
+  command=$2
+  case "$mode" in
+  native)
+    (cd "$DIR" && sh -c "$command") ;;
+  no-fs)
+    (cd "$DIR" && "$RSANDBOX" --no-fs -- sh -c "$command") ;;
+  fs)
+    # shellcheck disable=SC2086
+    (cd "$DIR" && "$RSANDBOX" --fs-allow "$DIR" $OPTS -- sh -c "$command") ;;
+  *)
+    log "unknown mode $mode"
+    exit 2 ;;
+  esac
+}
+
+json_string() {
+  printf '"%s"' "$(printf '%s' "$1" | sed 's/\\/\\\\/g; s/"/\\"/g')"
+}
+
+setup
+
+version=$(cat "$(dirname "$0")/../VERSION" 2>/dev/null || echo unknown)
+host=$(uname -r)
+
+for workload in $WORKLOADS; do
+  if test "$workload" = compile && ! command -v "$CC" > /dev/null; then
+    log "skipping compile: $CC not found"
+    continue
+  fi
+  command=$(workload_command "$workload")
+  for mode in $MODES; do
+    run=1
+    while test $run -le "$REPEAT"; do
+      log "$workload ($mode) run $run"
+      start=$(now)
+      if run_one "$mode" "$command"; then
+	status=0
+      else
+	status=$?
+      fi
+      end=$(now)
+      seconds=$(echo "$start $end" | awk '{ printf "%.3f", ($2 - $1) / 1e9 }')
+      opts=
+      test "$mode" = fs && opts=$OPTS
+      printf '{"workload": "%s", "mode": "%s", "run": %d, "seconds": %s, "status": %d, "scale": %d, "opts": %s, "version": %s, "kernel": %s}\n' \
+	"$workload" "$mode" "$run" "$seconds" "$status" "$SCALE" \
+	"$(json_string "$opts")" "$(json_string "$version")" \
+	"$(json_string "$host")"
+      run=$((run + 1))
+    done
+  done
+done
@@ -0,0 +1,319 @@
+/*
+  Copyright (c) 2012 Rohan McGovern <rohan@mcgovern.id.au>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+  LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <string>
+#include <vector>
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "cgroup.h"
+#include "mountinfo.h"
+#include "shared.h"
+
+/* clone3(2) is not wrapped by glibc, and may be missing from headers */
+#ifndef SYS_clone3
+#define SYS_clone3 435
+#endif
+
+#define SANDBOX_CLONE_INTO_CGROUP 0x200000000ULL
+
+/* leaf below its own cgroup that rsandbox moves into by default */
+#define SELF_CGROUP APPNAME ".self"
+
+struct sandbox_clone_args {
+  uint64_t flags;
+  uint64_t pidfd;
+  uint64_t child_tid;
+  uint64_t parent_tid;
+  uint64_t exit_signal;
+  uint64_t stack;
+  uint64_t stack_size;
+  uint64_t tls;
+  uint64_t set_tid;
+  uint64_t set_tid_size;
+  uint64_t cgroup;
+};
+
+/* mount point of the cgroup v2 hierarchy, or "" with an error printed */
+static std::string cgroup2_mountpoint()
+{
+  std::vector<MountInfo> mounts;
+  if (read_mountinfo(&mounts)) {
+    return "";
+  }
+  for (MountInfo const& info : mounts) {
+    if (info.fstype == "cgroup2") {
+      return info.mountpoint;
+    }
+  }
+  fprintf(stderr, "cgroup: no cgroup2 filesystem is mounted\n");
+  return "";
+}
+
+/* path of the calling process's cgroup, relative to the mount point */
+static std::string own_cgroup()
+{
+  FILE* file = fopen("/proc/self/cgroup", "r");
+  if (!file) {
+    perror("cgroup: /proc/self/cgroup");
+    return "";
+  }
+  std::string out;
+  char line[4096];
+  while (fgets(line, sizeof(line), file)) {
+    if (!strncmp(line, "0::", 3)) {
+      out = line + 3;
+      out.erase(out.find_last_not_of('\n') + 1);
+      break;
+    }
+  }
+  fclose(file);
+  if (out.empty()) {
+    fprintf(stderr, "cgroup: this process is not in a cgroup v2 group\n");
+  }
+  return out;
+}
+
+static std::string read_file(std::string const& path)
+{
+  std::string out;
+  FILE* file = fopen(path.c_str(), "r");
+  if (file) {
+    char buf[4096];
+    size_t len = fread(buf, 1, sizeof(buf) - 1, file);
+    out.assign(buf, len);
+    fclose(file);
+  }
+  return out;
+}
+
+static int write_file(int dirfd, std::string const& dir, const char* name,
+		      std::string const& value)
+{
+  debug("cgroup: %s/%s: %s\n", dir.c_str(), name, value.c_str());
+  int fd = openat(dirfd, name, O_WRONLY|O_CLOEXEC);
+  if (fd == -1 || write(fd, value.c_str(), value.length()) == -1) {
+    fprintf(stderr, "cgroup: write '%s' to %s/%s: %s\n", value.c_str(),
+	    dir.c_str(), name, strerror(errno));
+    if (fd != -1) {
+      close(fd);
+    }
+    return -1;
+  }
+  close(fd);
+  return 0;
+}
+
+static bool has_word(std::string const& list, std::string const& word)
+{
+  size_t pos = 0;
+  while ((pos = list.find(word, pos)) != std::string::npos) {
+    size_t end = pos + word.length();
+    if ((!pos || isspace(list[pos-1]))
+	&& (end == list.length() || isspace(list[end]))) {
+      return true;
+    }
+    pos = end;
+  }
+  return false;
+}
+
+/* make the controller available to children of parent */
+static int enable_controller(std::string const& parent, const char* name)
+{
+  if (has_word(read_file(parent + "/cgroup.subtree_control"), name)) {
+    return 0;
+  }
+  if (!has_word(read_file(parent + "/cgroup.controllers"), name)) {
+    fprintf(stderr, "cgroup: the %s controller is not available in %s\n",
+	    name, parent.c_str());
+    return -1;
+  }
+
+  int dirfd = open(parent.c_str(), O_DIRECTORY|O_CLOEXEC);
+  if (dirfd == -1) {
+    fprintf(stderr, "cgroup: open %s: %s\n", parent.c_str(), strerror(errno));
+    return -1;
+  }
+  int result = write_file(dirfd, parent, "cgroup.subtree_control",
+			  std::string("+") + name);
+  if (result && errno == EBUSY) {
+    fprintf(stderr, "cgroup: %s contains processes, so controllers can't be "
+	    "enabled for its children.\n"
+	    "Run rsandbox in a cgroup of its own (e.g. with systemd-run "
+	    "--scope),\nor use --cgroup-parent to name a cgroup with no "
+	    "processes.\n", parent.c_str());
+  }
+  close(dirfd);
+  return result;
+}
+
+/*
+  The default parent: the cgroup rsandbox runs in, which rsandbox first
+  leaves for a leaf SELF_CGROUP below it, as a cgroup other than the root
+  can't have controllers enabled for its children while it contains
+  processes. Returns the parent relative to the mount point, or "" with
+  an error printed.
+*/
+static std::string default_parent(std::string const& mountpoint)
+{
+  std::string own = own_cgroup();
+  std::string leaf = "/" SELF_CGROUP;
+  if (own.empty() || own == "/") {
+    return own;
+  }
+  if (own.length() > leaf.length()
+      && 0 == own.compare(own.length() - leaf.length(), leaf.length(), leaf)) {
+    return own.substr(0, own.length() - leaf.length());
+  }
+
+  leaf = mountpoint + own + leaf;
+  if (mkdir(leaf.c_str(), 0755) && errno != EEXIST) {
+    fprintf(stderr, "cgroup: create %s: %s\n", leaf.c_str(), strerror(errno));
+    return "";
+  }
+  int dirfd = open(leaf.c_str(), O_DIRECTORY|O_CLOEXEC);
+  if (dirfd == -1) {
+    fprintf(stderr, "cgroup: open %s: %s\n", leaf.c_str(), strerror(errno));
+    return "";
+  }
+  int result = write_file(dirfd, leaf, "cgroup.procs", "0");
+  close(dirfd);
+  return result ? "" : own;
+}
+
+int cgroup_create(const Context* ctx, std::string* path)
+{
+  std::string mountpoint = cgroup2_mountpoint();
+  if (mountpoint.empty()) {
+    return -1;
+  }
+  std::string relative = ctx->cgroup_parent;
+  if (relative.empty()) {
+    relative = default_parent(mountpoint);
+  } else if (relative[0] != '/') {
+    relative = "/" + relative;
+  }
+  if (relative.empty()) {
+    return -1;
+  }
+  std::string parent = mountpoint + (relative == "/" ? "" : relative);
+
+  struct {
+    const char* controller;
+    const char* file;
+    std::string const& value;
+  } limits[] = {
+    { "memory", "memory.max", ctx->memory_max },
+    { "cpu", "cpu.max", ctx->cpu_max },
+    { "pids", "pids.max", ctx->pids_max },
+  };
+  for (auto const& limit : limits) {
+    if (!limit.value.empty() && enable_controller(parent, limit.controller)) {
+      return -1;
+    }
+  }
+  if (!ctx->io_max.empty() && enable_controller(parent, "io")) {
+    return -1;
+  }
+
+  std::string tmpl = parent + "/" APPNAME "-XXXXXX";
+  if (!mkdtemp(&tmpl[0])) {
+    fprintf(stderr, "cgroup: create %s: %s\n", tmpl.c_str(), strerror(errno));
+    return -1;
+  }
+  int fd = open(tmpl.c_str(), O_DIRECTORY|O_CLOEXEC);
+  if (fd == -1) {
+    fprintf(stderr, "cgroup: open %s: %s\n", tmpl.c_str(), strerror(errno));
+    rmdir(tmpl.c_str());
+    return -1;
+  }
+  debug("cgroup: created %s\n", tmpl.c_str());
+
+  int result = 0;
+  for (auto const& limit : limits) {
+    if (!limit.value.empty()) {
+      result = result || write_file(fd, tmpl, limit.file, limit.value);
+    }
+  }
+  for (std::string const& value : ctx->io_max) {
+    result = result || write_file(fd, tmpl, "io.max", value);
+  }
+  if (result) {
+    close(fd);
+    rmdir(tmpl.c_str());
+    return -1;
+  }
+
+  *path = tmpl;
+  return fd;
+}
+
+pid_t cgroup_clone(int flags, int cgroup_fd)
+{
+  struct sandbox_clone_args args;
+  memset(&args, 0, sizeof(args));
+  args.flags = flags | SANDBOX_CLONE_INTO_CGROUP;
+  args.exit_signal = SIGCHLD;
+  args.cgroup = cgroup_fd;
+  pid_t pid = syscall(SYS_clone3, &args, sizeof(args));
+  if (pid == -1 && errno == E2BIG) {
+    /* kernel has clone3, but too old for CLONE_INTO_CGROUP */
+    errno = ENOSYS;
+  }
+  return pid;
+}
+
+int cgroup_enter(int cgroup_fd)
+{
+  /* "0" is the writing process */
+  return write_file(cgroup_fd, "sandbox cgroup", "cgroup.procs", "0");
+}
+
+void cgroup_remove(int cgroup_fd, std::string const& path)
+{
+  close(cgroup_fd);
+
+  /*
+    When the sandbox's init process exits, the kernel kills the rest of the
+    sandbox, but they may take a moment to leave the cgroup.
+  */
+  for (int tries = 0; rmdir(path.c_str()); ++tries) {
+    if (errno != EBUSY || tries == 100) {
+      fprintf(stderr, "rsandbox: warning: could not remove cgroup %s: %s\n",
+	      path.c_str(), strerror(errno));
+      return;
+    }
+    usleep(10000);
+  }
+}
@@ -0,0 +1,58 @@
+#ifndef SANDBOX_CGROUP_H
+#define SANDBOX_CGROUP_H
+
+
+/*
+  Copyright (c) 2012 Rohan McGovern <rohan@mcgovern.id.au>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+  LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <string>
+
+#include <sys/types.h>
+
+struct Context;
+
+/*
+  Create a cgroup v2 group for one sandbox below ctx->cgroup_parent, a
+  path within the cgroup hierarchy (by default, the cgroup of the calling
+  process, which first moves into a leaf below it), enabling the controllers
+  needed for the limits given by --memory-max, --cpu-max, --io-max and
+  --pids-max. Returns a descriptor for the group and sets *path, or
+  returns -1 with an error printed.
+*/
+int cgroup_create(const Context* ctx, std::string* path);
+
+/*
+  clone() with the given flags as fork() does, with the child starting in
+  the cgroup (clone3 with CLONE_INTO_CGROUP, Linux 5.7+). Returns -1 with
+  errno set to ENOSYS if the kernel can't do this.
+*/
+pid_t cgroup_clone(int flags, int cgroup_fd);
+
+/* move the calling process into the cgroup; returns 0, or -1 with an error
+   printed */
+int cgroup_enter(int cgroup_fd);
+
+/* close and remove the cgroup, once the processes in it have gone */
+void cgroup_remove(int cgroup_fd, std::string const& path);
+
+#endif
@@ -0,0 +1,151 @@
+/*
+  Copyright (c) 2012 Rohan McGovern <rohan@mcgovern.id.au>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+  LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "content_cache.h"
+
+bool ContentCache::Key::operator==(Key const& other) const
+{
+  return dev == other.dev && ino == other.ino && size == other.size
+    && mtime.tv_sec == other.mtime.tv_sec
+    && mtime.tv_nsec == other.mtime.tv_nsec
+    && ctime.tv_sec == other.ctime.tv_sec
+    && ctime.tv_nsec == other.ctime.tv_nsec;
+}
+
+ContentCache::Key ContentCache::key_of(const struct stat& st)
+{
+  Key key;
+  key.dev = st.st_dev;
+  key.ino = st.st_ino;
+  key.mtime = st.st_mtim;
+  key.ctime = st.st_ctim;
+  key.size = st.st_size;
+  return key;
+}
+
+size_t ContentCache::KeyHash::operator()(Key const& key) const
+{
+  size_t out = key.ino;
+  out = out * 31 + key.dev;
+  out = out * 31 + key.mtime.tv_nsec;
+  return out;
+}
+
+ContentCache::ContentCache()
+  : _size(0), _capacity(0), _max_file(0)
+{
+}
+
+void ContentCache::start(size_t capacity, size_t max_file)
+{
+  _capacity = capacity;
+  _max_file = max_file < capacity ? max_file : capacity;
+}
+
+/* read a whole file expected to be size bytes, or return null */
+ContentCache::Content ContentCache::read(int fd, size_t size)
+{
+  std::string* data = new std::string(size, 0);
+  Content out(data);
+  size_t done = 0;
+  for (;;) {
+    /* one more byte than expected, to see that the file hasn't grown */
+    char extra;
+    char* buf = done < size ? &(*data)[done] : &extra;
+    ssize_t n = pread(fd, buf, done < size ? size - done : 1, done);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 || (n == 0 && done < size) || (n > 0 && done == size)) {
+      return Content();
+    }
+    if (n == 0) {
+      return out;
+    }
+    done += n;
+  }
+}
+
+ContentCache::Content ContentCache::get(int fd, const struct stat& st)
+{
+  if (!enabled() || !S_ISREG(st.st_mode) || size_t(st.st_size) > _max_file) {
+    return Content();
+  }
+
+  Key key = key_of(st);
+
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto found = _index.find(key);
+    if (found != _index.end()) {
+      _entries.splice(_entries.begin(), _entries, found->second);
+      return found->second->content;
+    }
+  }
+
+  /* read without the lock; another thread may do the same meanwhile */
+  Content content = read(fd, st.st_size);
+  if (!content) {
+    return content;
+  }
+
+  /*
+    A file rewritten in place while being read may keep its size, and its
+    times if within one tick of the kernel's coarse clock; so the contents
+    aren't cached unless the file is unchanged after the read, and hasn't
+    been changed within the last second either.
+  */
+  struct stat after;
+  if (fstat(fd, &after) || !(key_of(after) == key)) {
+    return Content();
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  if (now.tv_sec - after.st_mtim.tv_sec <= 1
+      || now.tv_sec - after.st_ctim.tv_sec <= 1) {
+    return content;
+  }
+
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (_index.count(key)) {
+    return content;
+  }
+  Entry entry;
+  entry.key = key;
+  entry.content = content;
+  _entries.push_front(entry);
+  _index[key] = _entries.begin();
+  _size += content->size();
+
+  while (_size > _capacity) {
+    Entry& last = _entries.back();
+    _size -= last.content->size();
+    _index.erase(last.key);
+    _entries.pop_back();
+  }
+  return content;
+}
@@ -0,0 +1,99 @@
+#ifndef SANDBOX_CONTENT_CACHE_H
+#define SANDBOX_CONTENT_CACHE_H
+
+
+/*
+  Copyright (c) 2012 Rohan McGovern <rohan@mcgovern.id.au>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+  LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+/*
+  Contents of small files for the FUSE process (--fs-content-cache), so
+  that files read over and over, such as headers and scripts, are served
+  from memory rather than with a pread() for each read.
+
+  Entries are keyed on the device, inode, modification time and size of
+  the file, as given by an fstat() of each newly opened file, so a file
+  changed in any of those is read again; old contents are never served
+  for a new key, only left to age out. The total size of the entries is
+  bounded, evicting the least recently used.
+*/
+class ContentCache {
+ public:
+  typedef std::shared_ptr<const std::string> Content;
+
+  ContentCache();
+
+  /* cache up to capacity bytes, of files up to max_file bytes */
+  void start(size_t capacity, size_t max_file);
+  bool enabled() const { return _capacity != 0; }
+
+  /*
+    The contents of the open file fd, whose fstat() is st: from the cache,
+    or else read and cached. Null if the file is too large, isn't a
+    regular file, or changes while being read.
+  */
+  Content get(int fd, const struct stat& st);
+
+ private:
+  struct Key {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    struct timespec ctime;
+    off_t size;
+    bool operator==(Key const&) const;
+  };
+
+  static Key key_of(const struct stat& st);
+
+  struct KeyHash {
+    size_t operator()(Key const&) const;
+  };
+
+  struct Entry {
+    Key key;
+    Content content;
+  };
+
+  typedef std::list<Entry> List;
+
+  static Content read(int fd, size_t size);
+
+  std::mutex _mutex;
+  List _entries;  /* most recently used first */
+  std::unordered_map<Key, List::iterator, KeyHash> _index;
+  size_t _size;
+  size_t _capacity;
+  size_t _max_file;
+};
+
+#endif
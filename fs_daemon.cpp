@@ -0,0 +1,289 @@
+/*
+  Copyright (c) 2012 Rohan McGovern <rohan@mcgovern.id.au>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+  LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+  A FUSE daemon shared by many sandboxes (--fs-daemon), and its client
+  (--fs-connect).
+
+  Rather than forking a FUSE process, a sandbox using the daemon opens
+  /dev/fuse and mounts the filesystem itself, then passes the fd and its
+  filesystem options to the daemon over a Unix socket. The daemon serves
+  each sandbox on threads of its own, with the sandbox's policy, but all
+  from one process with one attribute cache. A sandbox's session ends when
+  its filesystem is unmounted, which happens at the latest when the
+  sandbox's mount namespace goes away.
+*/
+
+#include "fs_daemon.h"
+#include "fuse_sandbox.h"
+#include "shared.h"
+#include "sockets.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mount.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <thread>
+#include <vector>
+
+/* largest accepted request (mount point and writable paths) */
+#define REQUEST_MAX_SIZE (1 << 20)
+
+/* the options of a sandbox which apply to its filesystem */
+enum {
+  FIELD_FS_CACHE,
+  FIELD_WRITEBACK_CACHE,
+  FIELD_MAX_WRITE,
+  FIELD_MAX_READ,
+  FIELD_MAX_READAHEAD,
+  FIELD_MAX_BACKGROUND,
+  FIELD_PATHS,
+  FIELDS
+};
+
+/*
+  A request is sent as a 32-bit length with the /dev/fuse fd attached,
+  followed by that many bytes: the FIELD_ values as 32-bit integers, then
+  the mount point and the FIELD_PATHS writable paths as NUL-terminated
+  strings. The daemon replies with the 32-bit init status of the
+  filesystem, as the FUSE process does on its status pipe.
+*/
+int connect_fs_daemon(const Context* ctx)
+{
+  struct sockaddr_un addr;
+  if (socket_address(ctx->fs_connect_socket, &addr)) {
+    return -1;
+  }
+
+  int sock = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+  if (sock == -1) {
+    perror("socket");
+    return -1;
+  }
+  if (connect(sock, (struct sockaddr*)&addr, sizeof(addr))) {
+    fprintf(stderr, "connect %s: %s\n", ctx->fs_connect_socket.c_str(),
+	    strerror(errno));
+    close(sock);
+    return -1;
+  }
+
+  /*
+    Keep the mount out of the parent namespace, so that it goes away with
+    this one however the sandbox exits; --fs-connect requires the pid
+    sandbox, which gives this process a mount namespace of its own.
+  */
+  if (mount(0, "/", 0, MS_REC|MS_PRIVATE, 0)) {
+    perror("mount --make-rprivate /");
+    close(sock);
+    return -1;
+  }
+
+  int fd = open("/dev/fuse", O_RDWR|O_CLOEXEC);
+  if (fd == -1) {
+    perror("open /dev/fuse");
+    close(sock);
+    return -1;
+  }
+
+  char options[128];
+  int len = snprintf(options, sizeof(options),
+		     "fd=%d,rootmode=%o,user_id=%u,group_id=%u", fd, S_IFDIR,
+		     getuid(), getgid());
+  if (ctx->fs_max_read) {
+    snprintf(options + len, sizeof(options) - len, ",max_read=%u",
+	     ctx->fs_max_read);
+  }
+  if (mount(APPNAME, ctx->fuse_mountpoint.c_str(), "fuse." APPNAME,
+	    MS_NOSUID|MS_NODEV, options)) {
+    fprintf(stderr, "mount %s: %s\n", ctx->fuse_mountpoint.c_str(),
+	    strerror(errno));
+    close(fd);
+    close(sock);
+    return -1;
+  }
+
+  std::string payload;
+  put_u32(&payload, ctx->fs_cache);
+  put_u32(&payload, ctx->fs_writeback_cache);
+  put_u32(&payload, ctx->fs_max_write);
+  put_u32(&payload, ctx->fs_max_read);
+  put_u32(&payload, ctx->fs_max_readahead);
+  put_u32(&payload, ctx->fs_max_background);
+  put_u32(&payload, ctx->fuse_writable_paths.size());
+  put_string(&payload, ctx->fuse_mountpoint.c_str());
+  for (std::string const& path : ctx->fuse_writable_paths) {
+    put_string(&payload, path.c_str());
+  }
+
+  uint32_t size = payload.length();
+  int32_t status = -1;
+  if (send_fds(sock, &size, sizeof(size), &fd, 1)
+      || send_all(sock, payload.data(), size)) {
+    perror("send to FUSE daemon");
+  } else if (read_all(sock, &status, sizeof(status))) {
+    fprintf(stderr, "rsandbox: FUSE daemon closed connection\n");
+    status = -1;
+  }
+  close(fd);
+  close(sock);
+
+  if (status) {
+    disconnect_fs_daemon(ctx);
+    return -1;
+  }
+  debug("fs daemon: mounted %s\n", ctx->fuse_mountpoint.c_str());
+  return 0;
+}
+
+void disconnect_fs_daemon(const Context* ctx)
+{
+  if (umount2(ctx->fuse_mountpoint.c_str(), MNT_DETACH)) {
+    fprintf(stderr, "warning: could not unmount %s: %s\n",
+	    ctx->fuse_mountpoint.c_str(), strerror(errno));
+  }
+}
+
+/* read a request from a client, then serve its filesystem until unmounted */
+static void serve_client(const Context* daemon, int conn)
+{
+  uint32_t size;
+  int fd;
+  if (recv_fds(conn, &size, sizeof(size), &fd, 1)) {
+    fprintf(stderr, "fs daemon: no request received\n");
+    close(conn);
+    return;
+  }
+  if (size < FIELDS * sizeof(uint32_t) || size > REQUEST_MAX_SIZE) {
+    fprintf(stderr, "fs daemon: invalid size %u\n", size);
+    close(fd);
+    close(conn);
+    return;
+  }
+
+  std::vector<char> payload(size + 1);
+  if (read_all(conn, payload.data(), size)) {
+    fprintf(stderr, "fs daemon: short read\n");
+    close(fd);
+    close(conn);
+    return;
+  }
+  payload[size] = 0;
+
+  uint32_t fields[FIELDS];
+  memcpy(fields, payload.data(), sizeof(fields));
+  const char* p = payload.data() + sizeof(fields);
+  const char* end = payload.data() + size;
+  std::vector<std::string> strings;
+  while (p < end) {
+    strings.push_back(p);
+    p += strings.back().length() + 1;
+  }
+  if (strings.size() != 1 + fields[FIELD_PATHS] || strings[0].empty()) {
+    fprintf(stderr, "fs daemon: malformed request\n");
+    close(fd);
+    close(conn);
+    return;
+  }
+
+  /* the daemon's own options apply to everything else */
+  Context ctx = *daemon;
+  ctx.fs_cache = fields[FIELD_FS_CACHE];
+  ctx.fs_writeback_cache = fields[FIELD_WRITEBACK_CACHE] ? 1 : 0;
+  ctx.fs_max_write = fields[FIELD_MAX_WRITE];
+  ctx.fs_max_read = fields[FIELD_MAX_READ];
+  ctx.fs_max_readahead = fields[FIELD_MAX_READAHEAD];
+  ctx.fs_max_background = fields[FIELD_MAX_BACKGROUND];
+  ctx.fuse_mountpoint = strings[0];
+  ctx.fuse_writable_paths.assign(strings.begin() + 1, strings.end());
+
+  debug("fs daemon: serving %s\n", ctx.fuse_mountpoint.c_str());
+  serve_fuse_sandbox(&ctx, fd, conn);
+  debug("fs daemon: %s unmounted\n", ctx.fuse_mountpoint.c_str());
+}
+
+static volatile sig_atomic_t stopping = 0;
+
+static void daemon_terminate(int)
+{
+  stopping = 1;
+}
+
+int run_fs_daemon(const Context* ctx)
+{
+  struct sockaddr_un addr;
+  if (socket_address(ctx->fs_daemon_socket, &addr)) {
+    return 255;
+  }
+
+  if (start_fuse_daemon(ctx)) {
+    return 255;
+  }
+
+  /* only this user's sandboxes may be served, with this user's access */
+  int listen_fd = listen_socket(addr);
+  if (listen_fd == -1) {
+    return 255;
+  }
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = daemon_terminate;
+  sigaction(SIGTERM, &sa, 0);
+  sigaction(SIGINT, &sa, 0);
+  /* a sandbox may exit before its init status is sent */
+  signal(SIGPIPE, SIG_IGN);
+
+  while (!stopping) {
+    int conn = accept4(listen_fd, 0, 0, SOCK_CLOEXEC);
+    if (conn == -1) {
+      if (errno != EINTR) {
+	perror("accept");
+	sleep(1);
+      }
+      continue;
+    }
+
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len)
+	|| cred.uid != geteuid()) {
+      fprintf(stderr, "fs daemon: rejected connection from another user\n");
+      close(conn);
+      continue;
+    }
+
+    std::thread(serve_client, ctx, conn).detach();
+  }
+
+  /* filesystems still mounted fail with ENOTCONN once this process exits */
+  debug("fs daemon: stopping\n");
+  unlink(addr.sun_path);
+  return 0;
+}
@@ -0,0 +1,46 @@
+#ifndef SANDBOX_FS_DAEMON_H
+#define SANDBOX_FS_DAEMON_H
+
+
+/*
+  Copyright (c) 2012 Rohan McGovern <rohan@mcgovern.id.au>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+  LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+struct Context;
+
+/*
+  --fs-daemon: serve the filesystems of sandboxes started with
+  --fs-connect, all from this process. Returns when terminated.
+*/
+int run_fs_daemon(const Context*);
+
+/*
+  --fs-connect: mount the sandbox filesystem at ctx->fuse_mountpoint, served
+  by the daemon. Returns 0, or -1 with an error printed.
+*/
+int connect_fs_daemon(const Context*);
+
+/* unmount the filesystem mounted by connect_fs_daemon() */
+void disconnect_fs_daemon(const Context*);
+
+#endif
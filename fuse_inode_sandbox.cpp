@@ -0,0 +1,972 @@
+/*
+  Copyright (c) 2012 Rohan McGovern <rohan@mcgovern.id.au>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+  LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+  Inode-based FUSE engine.
+
+  Unlike the engine in fuse_sandbox.cpp, which is given a full path for
+  every operation and resolves it again from /, this engine uses the
+  low-level FUSE API and keeps an O_PATH file descriptor for each inode
+  known to the kernel. Each operation is performed with *at() calls
+  relative to that fd, so the cost doesn't depend on the depth of the
+  file in the tree.
+
+  Each inode also remembers its position in the access policy, so checking
+  access to a child costs one policy step.
+*/
+
+/* normally set by the Makefile according to the installed libfuse */
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 35
+#endif
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <fuse_lowlevel.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/xattr.h>
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "shared.h"
+#include "audit.h"
+#include "fuse_sandbox.h"
+#include "fuse_inode_sandbox.h"
+#include "policy.h"
+#include "stats.h"
+#include "trace.h"
+
+struct Inode {
+  int fd;                 /* O_PATH */
+  dev_t dev;
+  ino_t ino;
+  unsigned is_symlink :1;
+  Policy::Cursor cursor;
+  uint64_t nlookup;
+
+  /* for --fs-cache=auto: attributes as of the last open */
+  struct timespec open_mtime;
+  off_t open_size;
+};
+
+/*
+  Inodes are keyed by policy position as well as (dev, ino), since the
+  same file may be reachable by paths with different access (e.g. through
+  a bind mount).
+*/
+struct InodeKey {
+  dev_t dev;
+  ino_t ino;
+  int node;
+  unsigned flags;
+
+  bool operator==(InodeKey const& other) const
+  {
+    return dev == other.dev && ino == other.ino
+      && node == other.node && flags == other.flags;
+  }
+};
+
+struct InodeKeyHash {
+  size_t operator()(InodeKey const& key) const
+  {
+    return std::hash<uint64_t>()(key.ino ^ (uint64_t(key.dev) << 32))
+      ^ std::hash<int>()(key.node) ^ key.flags;
+  }
+};
+
+struct DirHandle {
+  DIR* dir;
+  off_t offset;
+  struct dirent* entry;
+  Policy::Cursor cursor;
+};
+
+static const Policy* policy;
+static const Context* context;
+static int fs_cache;
+static double entry_timeout;
+static double attr_timeout;
+static double negative_timeout;
+static bool writeback_cache;
+
+static Inode root;
+static std::mutex inodes_mutex;
+static std::unordered_map<InodeKey, Inode*, InodeKeyHash> inodes;
+
+static Inode& get_inode(fuse_ino_t ino)
+{
+  if (ino == FUSE_ROOT_ID) {
+    return root;
+  }
+  return *reinterpret_cast<Inode*>(uintptr_t(ino));
+}
+
+static fuse_ino_t inode_id(Inode* inode)
+{
+  if (inode == &root) {
+    return FUSE_ROOT_ID;
+  }
+  return uintptr_t(inode);
+}
+
+static DirHandle* get_dir(struct fuse_file_info* fi)
+{
+  return reinterpret_cast<DirHandle*>(uintptr_t(fi->fh));
+}
+
+/* path which may be used to reopen or modify the given inode */
+#define PROC_PATH(name, inode)						\
+  char name[64];							\
+  snprintf(name, sizeof(name), "/proc/self/fd/%d", (inode).fd)
+
+#define REPLY_ERRNO(req, result)		\
+  do {						\
+    if (-1 == (result)) {			\
+      fuse_reply_err(req, errno);		\
+      return;					\
+    }						\
+  } while(0)
+
+/*
+  Record a write check of name in the directory fd, or of fd itself if
+  name is null. The path is found from fd only for a record, as the
+  FUSE process sees it.
+*/
+static void audit_write(fuse_req_t req, int op, int fd, const char* name,
+			int result)
+{
+  char procpath[64];
+  snprintf(procpath, sizeof(procpath), "/proc/self/fd/%d", fd);
+  char path[PATH_MAX];
+  ssize_t length = readlink(procpath, path, sizeof(path) - 1);
+  if (length == -1) {
+    length = 0;
+  }
+  path[length] = 0;
+  std::string full(path);
+  if (name) {
+    if (full != "/") {
+      full += '/';
+    }
+    full += name;
+  }
+  audit_record(op, full.c_str(), fuse_req_ctx(req)->pid, result);
+}
+
+/*
+  fd and name give the file checked, as for audit_write(); writes are
+  audited as the operation of the enclosing STATS_TIMER.
+*/
+#define CHECK_ACCESS(req, cursor, write, fd, name)	\
+  do {							\
+    int denied = Policy::check(cursor, write);		\
+    if ((write) && audit_wanted(denied)) {		\
+      audit_write(req, stats_timer.op, fd, name,	\
+		  denied);				\
+    }							\
+    if (denied) {					\
+      fuse_reply_err(req, -denied);			\
+      return;						\
+    }							\
+  } while(0)
+
+/* look up name in parent, filling in e; returns 0 or an errno value */
+static int do_lookup(fuse_ino_t parent, const char* name,
+		     struct fuse_entry_param* e)
+{
+  Inode& dir = get_inode(parent);
+  Policy::Cursor cursor = policy->step(dir.cursor, name, strlen(name));
+  if (cursor.flags & Policy::HIDDEN) {
+    return ENOENT;
+  }
+
+  memset(e, 0, sizeof(*e));
+  e->attr_timeout = attr_timeout;
+  e->entry_timeout = entry_timeout;
+
+  int fd = openat(dir.fd, name, O_PATH|O_NOFOLLOW|O_CLOEXEC);
+  if (fd == -1) {
+    return errno;
+  }
+
+  if (-1 == fstatat(fd, "", &e->attr, AT_EMPTY_PATH|AT_SYMLINK_NOFOLLOW)) {
+    int saved_errno = errno;
+    close(fd);
+    return saved_errno;
+  }
+
+  InodeKey key = { e->attr.st_dev, e->attr.st_ino, cursor.node, cursor.flags };
+  Inode* inode;
+  {
+    std::lock_guard<std::mutex> lock(inodes_mutex);
+    auto it = inodes.find(key);
+    if (it != inodes.end()) {
+      inode = it->second;
+      close(fd);
+    } else {
+      inode = new Inode{};
+      inode->fd = fd;
+      inode->dev = e->attr.st_dev;
+      inode->ino = e->attr.st_ino;
+      inode->is_symlink = S_ISLNK(e->attr.st_mode);
+      inode->cursor = cursor;
+      inodes[key] = inode;
+    }
+    ++inode->nlookup;
+  }
+
+  e->ino = inode_id(inode);
+  return 0;
+}
+
+static void forget_one(fuse_ino_t ino, uint64_t nlookup)
+{
+  Inode& inode = get_inode(ino);
+  if (&inode == &root) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(inodes_mutex);
+  inode.nlookup -= nlookup;
+  if (!inode.nlookup) {
+    InodeKey key = { inode.dev, inode.ino, inode.cursor.node,
+		     inode.cursor.flags };
+    inodes.erase(key);
+    close(inode.fd);
+    delete &inode;
+  }
+}
+
+/* reply to an operation which created name in parent */
+static void reply_created(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+  struct fuse_entry_param e;
+  int err = do_lookup(parent, name, &e);
+  if (err) {
+    fuse_reply_err(req, err);
+  } else {
+    fuse_reply_entry(req, &e);
+  }
+}
+
+void sandbox_ll_init(void* userdata, struct fuse_conn_info* conn)
+{
+  writeback_cache = fuse_sandbox_init(conn, context, *((int*)userdata));
+}
+
+void sandbox_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+  STATS_TIMER(STATS_LOOKUP);
+  struct fuse_entry_param e;
+  int err = do_lookup(parent, name, &e);
+  if (err == ENOENT && negative_timeout > 0) {
+    /* let the kernel cache the negative lookup */
+    memset(&e, 0, sizeof(e));
+    e.entry_timeout = negative_timeout;
+    fuse_reply_entry(req, &e);
+  } else if (err) {
+    fuse_reply_err(req, err);
+  } else {
+    fuse_reply_entry(req, &e);
+  }
+}
+
+void sandbox_ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+  STATS_TIMER(STATS_FORGET);
+  forget_one(ino, nlookup);
+  fuse_reply_none(req);
+}
+
+void sandbox_ll_forget_multi(fuse_req_t req, size_t count,
+			     struct fuse_forget_data* forgets)
+{
+  STATS_TIMER(STATS_FORGET);
+  for (size_t i = 0; i < count; ++i) {
+    forget_one(forgets[i].ino, forgets[i].nlookup);
+  }
+  fuse_reply_none(req);
+}
+
+static void reply_attr(fuse_req_t req, fuse_ino_t ino)
+{
+  struct stat st;
+  REPLY_ERRNO(req, fstatat(get_inode(ino).fd, "", &st,
+			   AT_EMPTY_PATH|AT_SYMLINK_NOFOLLOW));
+  fuse_reply_attr(req, &st, attr_timeout);
+}
+
+void sandbox_ll_getattr(fuse_req_t req, fuse_ino_t ino,
+			struct fuse_file_info* fi)
+{
+  STATS_TIMER(STATS_GETATTR);
+  if (fi) {
+    struct stat st;
+    REPLY_ERRNO(req, fstat(fi->fh, &st));
+    fuse_reply_attr(req, &st, attr_timeout);
+    return;
+  }
+  reply_attr(req, ino);
+}
+
+void sandbox_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat* attr,
+			int to_set, struct fuse_file_info* fi)
+{
+  STATS_TIMER(STATS_SETATTR);
+  Inode& inode = get_inode(ino);
+  CHECK_ACCESS(req, inode.cursor, 1, inode.fd, 0);
+  PROC_PATH(procpath, inode);
+
+  if (to_set & FUSE_SET_ATTR_MODE) {
+    REPLY_ERRNO(req, fi
+		? fchmod(fi->fh, attr->st_mode)
+		: chmod(procpath, attr->st_mode));
+  }
+
+  if (to_set & (FUSE_SET_ATTR_UID|FUSE_SET_ATTR_GID)) {
+    uid_t uid = (to_set & FUSE_SET_ATTR_UID) ? attr->st_uid : (uid_t)-1;
+    gid_t gid = (to_set & FUSE_SET_ATTR_GID) ? attr->st_gid : (gid_t)-1;
+    REPLY_ERRNO(req, fchownat(inode.fd, "", uid, gid,
+			      AT_EMPTY_PATH|AT_SYMLINK_NOFOLLOW));
+  }
+
+  if (to_set & FUSE_SET_ATTR_SIZE) {
+    REPLY_ERRNO(req, fi
+		? ftruncate(fi->fh, attr->st_size)
+		: truncate(procpath, attr->st_size));
+  }
+
+  if (to_set & (FUSE_SET_ATTR_ATIME|FUSE_SET_ATTR_MTIME)) {
+    struct timespec tv[2];
+    tv[0].tv_sec = tv[1].tv_sec = 0;
+    tv[0].tv_nsec = tv[1].tv_nsec = UTIME_OMIT;
+
+    if (to_set & FUSE_SET_ATTR_ATIME_NOW) {
+      tv[0].tv_nsec = UTIME_NOW;
+    } else if (to_set & FUSE_SET_ATTR_ATIME) {
+      tv[0] = attr->st_atim;
+    }
+    if (to_set & FUSE_SET_ATTR_MTIME_NOW) {
+      tv[1].tv_nsec = UTIME_NOW;
+    } else if (to_set & FUSE_SET_ATTR_MTIME) {
+      tv[1] = attr->st_mtim;
+    }
+
+    if (fi) {
+      REPLY_ERRNO(req, futimens(fi->fh, tv));
+    } else if (inode.is_symlink) {
+      REPLY_ERRNO(req, utimensat(inode.fd, "", tv, AT_EMPTY_PATH));
+    } else {
+      REPLY_ERRNO(req, utimensat(AT_FDCWD, procpath, tv, 0));
+    }
+  }
+
+  reply_attr(req, ino);
+}
+
+void sandbox_ll_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+  STATS_TIMER(STATS_READLINK);
+  char buf[PATH_MAX + 1];
+  int result = readlinkat(get_inode(ino).fd, "", buf, sizeof(buf) - 1);
+  REPLY_ERRNO(req, result);
+  buf[result] = 0;
+  fuse_reply_readlink(req, buf);
+}
+
+void sandbox_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char* name,
+		      mode_t mode, dev_t rdev)
+{
+  STATS_TIMER(STATS_MKNOD);
+  Inode& dir = get_inode(parent);
+  CHECK_ACCESS(req, policy->step(dir.cursor, name, strlen(name)), 1,
+	       dir.fd, name);
+  REPLY_ERRNO(req, mknodat(dir.fd, name, mode, rdev));
+  reply_created(req, parent, name);
+}
+
+void sandbox_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char* name,
+		      mode_t mode)
+{
+  STATS_TIMER(STATS_MKDIR);
+  Inode& dir = get_inode(parent);
+  CHECK_ACCESS(req, policy->step(dir.cursor, name, strlen(name)), 1,
+	       dir.fd, name);
+  REPLY_ERRNO(req, mkdirat(dir.fd, name, mode));
+  reply_created(req, parent, name);
+}
+
+void sandbox_ll_symlink(fuse_req_t req, const char* link, fuse_ino_t parent,
+			const char* name)
+{
+  STATS_TIMER(STATS_SYMLINK);
+  Inode& dir = get_inode(parent);
+  CHECK_ACCESS(req, policy->step(dir.cursor, name, strlen(name)), 1,
+	       dir.fd, name);
+  REPLY_ERRNO(req, symlinkat(link, dir.fd, name));
+  reply_created(req, parent, name);
+}
+
+void sandbox_ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+		     const char* newname)
+{
+  STATS_TIMER(STATS_LINK);
+  Inode& dir = get_inode(newparent);
+  CHECK_ACCESS(req, policy->step(dir.cursor, newname, strlen(newname)), 1,
+	       dir.fd, newname);
+  PROC_PATH(procpath, get_inode(ino));
+  REPLY_ERRNO(req, linkat(AT_FDCWD, procpath, dir.fd, newname,
+			  AT_SYMLINK_FOLLOW));
+  reply_created(req, newparent, newname);
+}
+
+void sandbox_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+  STATS_TIMER(STATS_UNLINK);
+  Inode& dir = get_inode(parent);
+  CHECK_ACCESS(req, policy->step(dir.cursor, name, strlen(name)), 1,
+	       dir.fd, name);
+  REPLY_ERRNO(req, unlinkat(dir.fd, name, 0));
+  fuse_reply_err(req, 0);
+}
+
+void sandbox_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+  STATS_TIMER(STATS_RMDIR);
+  Inode& dir = get_inode(parent);
+  CHECK_ACCESS(req, policy->step(dir.cursor, name, strlen(name)), 1,
+	       dir.fd, name);
+  REPLY_ERRNO(req, unlinkat(dir.fd, name, AT_REMOVEDIR));
+  fuse_reply_err(req, 0);
+}
+
+void sandbox_ll_rename(fuse_req_t req, fuse_ino_t parent, const char* name,
+		       fuse_ino_t newparent, const char* newname,
+		       unsigned int flags)
+{
+  STATS_TIMER(STATS_RENAME);
+  Inode& dir = get_inode(parent);
+  Inode& newdir = get_inode(newparent);
+  CHECK_ACCESS(req, policy->step(dir.cursor, name, strlen(name)), 1,
+	       dir.fd, name);
+  CHECK_ACCESS(req, policy->step(newdir.cursor, newname, strlen(newname)), 1,
+	       newdir.fd, newname);
+  REPLY_ERRNO(req, renameat2(dir.fd, name, newdir.fd, newname, flags));
+  fuse_reply_err(req, 0);
+}
+
+/* set caching flags on a newly opened file according to --fs-cache */
+static void set_open_flags(Inode& inode, int fd, struct fuse_file_info* fi)
+{
+  switch (fs_cache) {
+  case FS_CACHE_NONE:
+    fi->direct_io = 1;
+    break;
+
+  case FS_CACHE_AGGRESSIVE:
+    fi->keep_cache = 1;
+    break;
+
+  default:
+    /* like libfuse's auto_cache: keep cached data if file is unchanged */
+    struct stat st;
+    if (0 == fstat(fd, &st)) {
+      std::lock_guard<std::mutex> lock(inodes_mutex);
+      if (inode.open_size == st.st_size
+	  && inode.open_mtime.tv_sec == st.st_mtim.tv_sec
+	  && inode.open_mtime.tv_nsec == st.st_mtim.tv_nsec) {
+	fi->keep_cache = 1;
+      }
+      inode.open_size = st.st_size;
+      inode.open_mtime = st.st_mtim;
+    }
+    break;
+  }
+}
+
+void sandbox_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+  STATS_TIMER(STATS_OPEN);
+  Inode& inode = get_inode(ino);
+  int flags = fi->flags;
+  CHECK_ACCESS(req, inode.cursor,
+	       flags&O_WRONLY || flags&O_RDWR || flags&O_TRUNC, inode.fd, 0);
+
+  PROC_PATH(procpath, inode);
+  int fd = open(procpath, fuse_sandbox_open_flags(flags, writeback_cache)
+			 & ~O_NOFOLLOW);
+  REPLY_ERRNO(req, fd);
+
+  fi->fh = fd;
+  set_open_flags(inode, fd, fi);
+  fuse_reply_open(req, fi);
+}
+
+void sandbox_ll_create(fuse_req_t req, fuse_ino_t parent, const char* name,
+		       mode_t mode, struct fuse_file_info* fi)
+{
+  STATS_TIMER(STATS_CREATE);
+  Inode& dir = get_inode(parent);
+  CHECK_ACCESS(req, policy->step(dir.cursor, name, strlen(name)), 1,
+	       dir.fd, name);
+
+  int fd = openat(dir.fd, name,
+		  fuse_sandbox_open_flags(fi->flags | O_CREAT, writeback_cache)
+		  & ~O_NOFOLLOW,
+		  mode);
+  REPLY_ERRNO(req, fd);
+  fi->fh = fd;
+
+  struct fuse_entry_param e;
+  int err = do_lookup(parent, name, &e);
+  if (err) {
+    close(fd);
+    fuse_reply_err(req, err);
+    return;
+  }
+  if (fs_cache == FS_CACHE_NONE) {
+    fi->direct_io = 1;
+  }
+  fuse_reply_create(req, &e, fi);
+}
+
+void sandbox_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+		     struct fuse_file_info* fi)
+{
+  STATS_TIMER(STATS_READ);
+  /* splice from the file where possible; see sandbox_read_buf */
+  struct fuse_bufvec buf = FUSE_BUFVEC_INIT(size);
+  buf.buf[0].flags = (enum fuse_buf_flags)(FUSE_BUF_IS_FD|FUSE_BUF_FD_SEEK);
+  buf.buf[0].fd = fi->fh;
+  buf.buf[0].pos = off;
+  if (0 == fuse_reply_data(req, &buf, FUSE_BUF_SPLICE_MOVE)
+      && stats_enabled) {
+    STATS_BYTES(fuse_sandbox_read_length(fi->fh, size, off));
+  }
+}
+
+void sandbox_ll_write(fuse_req_t req, fuse_ino_t ino, const char* buf,
+		      size_t size, off_t off, struct fuse_file_info* fi)
+{
+  STATS_TIMER(STATS_WRITE);
+  ssize_t result = pwrite(fi->fh, buf, size, off);
+  REPLY_ERRNO(req, result);
+  STATS_BYTES(result);
+  fuse_reply_write(req, result);
+}
+
+void sandbox_ll_write_buf(fuse_req_t req, fuse_ino_t ino,
+			  struct fuse_bufvec* buf, off_t off,
+			  struct fuse_file_info* fi)
+{
+  STATS_TIMER(STATS_WRITE);
+  struct fuse_bufvec dst = FUSE_BUFVEC_INIT(fuse_buf_size(buf));
+  dst.buf[0].flags = (enum fuse_buf_flags)(FUSE_BUF_IS_FD|FUSE_BUF_FD_SEEK);
+  dst.buf[0].fd = fi->fh;
+  dst.buf[0].pos = off;
+
+  ssize_t result = fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
+  if (result < 0) {
+    fuse_reply_err(req, -result);
+  } else {
+    STATS_BYTES(result);
+    fuse_reply_write(req, result);
+  }
+}
+
+void sandbox_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+  STATS_TIMER(STATS_FLUSH);
+  REPLY_ERRNO(req, close(dup(fi->fh)));
+  fuse_reply_err(req, 0);
+}
+
+void sandbox_ll_release(fuse_req_t req, fuse_ino_t ino,
+			struct fuse_file_info* fi)
+{
+  STATS_TIMER(STATS_RELEASE);
+  close(fi->fh);
+  fuse_reply_err(req, 0);
+}
+
+void sandbox_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+		      struct fuse_file_info* fi)
+{
+  STATS_TIMER(STATS_FSYNC);
+  REPLY_ERRNO(req, datasync ? fdatasync(fi->fh) : fsync(fi->fh));
+  fuse_reply_err(req, 0);
+}
+
+void sandbox_ll_opendir(fuse_req_t req, fuse_ino_t ino,
+			struct fuse_file_info* fi)
+{
+  STATS_TIMER(STATS_OPENDIR);
+  Inode& inode = get_inode(ino);
+  int fd = openat(inode.fd, ".", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+  REPLY_ERRNO(req, fd);
+
+  DIR* dir = fdopendir(fd);
+  if (!dir) {
+    int saved_errno = errno;
+    close(fd);
+    fuse_reply_err(req, saved_errno);
+    return;
+  }
+
+  DirHandle* handle = new DirHandle;
+  handle->dir = dir;
+  handle->offset = 0;
+  handle->entry = 0;
+  handle->cursor = inode.cursor;
+  fi->fh = uintptr_t(handle);
+  fuse_reply_open(req, fi);
+}
+
+static int is_dot_or_dotdot(const char* name)
+{
+  return name[0] == '.'
+    && (name[1] == 0 || (name[1] == '.' && name[2] == 0));
+}
+
+/*
+  readdir and readdirplus. With plus, each entry is looked up as by
+  lookup, saving the kernel a separate lookup for each entry.
+*/
+static void do_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+		       struct fuse_file_info* fi, int plus)
+{
+  DirHandle* handle = get_dir(fi);
+  char* buf = (char*)malloc(size);
+  if (!buf) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+
+  if (off != handle->offset) {
+    seekdir(handle->dir, off);
+    handle->entry = 0;
+    handle->offset = off;
+  }
+
+  size_t used = 0;
+  int err = 0;
+  for (;;) {
+    if (!handle->entry) {
+      errno = 0;
+      handle->entry = readdir(handle->dir);
+      if (!handle->entry) {
+	err = errno;
+	break;
+      }
+    }
+
+    struct dirent* ent = handle->entry;
+    off_t nextoff = telldir(handle->dir);
+
+    if (handle->cursor.node == -1
+	|| !(policy->step(handle->cursor, ent->d_name,
+			  strlen(ent->d_name)).flags & Policy::HIDDEN)) {
+      size_t entsize;
+      if (plus) {
+	/*
+	  Entries which can't be looked up (including . and ..) are
+	  returned with ino 0, so the kernel doesn't cache them.
+	*/
+	struct fuse_entry_param e;
+	if (is_dot_or_dotdot(ent->d_name)
+	    || do_lookup(ino, ent->d_name, &e)) {
+	  memset(&e, 0, sizeof(e));
+	  e.attr.st_ino = ent->d_ino;
+	  e.attr.st_mode = DTTOIF(ent->d_type);
+	}
+	entsize = fuse_add_direntry_plus(req, buf + used, size - used,
+					 ent->d_name, &e, nextoff);
+	if (entsize > size - used) {
+	  /* not returned to the kernel, so undo the lookup */
+	  if (e.ino) {
+	    forget_one(e.ino, 1);
+	  }
+	  break;
+	}
+      } else {
+	struct stat st{};
+	st.st_ino = ent->d_ino;
+	st.st_mode = DTTOIF(ent->d_type);
+	entsize = fuse_add_direntry(req, buf + used, size - used,
+				    ent->d_name, &st, nextoff);
+	if (entsize > size - used) {
+	  break;
+	}
+      }
+      used += entsize;
+    }
+
+    handle->entry = 0;
+    handle->offset = nextoff;
+  }
+
+  if (err && !used) {
+    fuse_reply_err(req, err);
+  } else {
+    fuse_reply_buf(req, buf, used);
+  }
+  free(buf);
+}
+
+void sandbox_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+			struct fuse_file_info* fi)
+{
+  STATS_TIMER(STATS_READDIR);
+  do_readdir(req, ino, size, off, fi, 0);
+}
+
+void sandbox_ll_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size,
+			    off_t off, struct fuse_file_info* fi)
+{
+  STATS_TIMER(STATS_READDIRPLUS);
+  do_readdir(req, ino, size, off, fi, 1);
+}
+
+void sandbox_ll_releasedir(fuse_req_t req, fuse_ino_t ino,
+			   struct fuse_file_info* fi)
+{
+  STATS_TIMER(STATS_RELEASEDIR);
+  DirHandle* handle = get_dir(fi);
+  closedir(handle->dir);
+  delete handle;
+  fuse_reply_err(req, 0);
+}
+
+void sandbox_ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+  STATS_TIMER(STATS_STATFS);
+  struct statvfs fs;
+  REPLY_ERRNO(req, fstatvfs(get_inode(ino).fd, &fs));
+  fuse_reply_statfs(req, &fs);
+}
+
+void sandbox_ll_access(fuse_req_t req, fuse_ino_t ino, int mask)
+{
+  STATS_TIMER(STATS_ACCESS);
+  PROC_PATH(procpath, get_inode(ino));
+  REPLY_ERRNO(req, access(procpath, mask));
+  fuse_reply_err(req, 0);
+}
+
+/*
+  Extended attributes are accessed through /proc/self/fd, which can't be
+  done without following symlinks; so they're not supported on symlinks.
+*/
+#define CHECK_NOT_SYMLINK(req, inode)		\
+  do {						\
+    if ((inode).is_symlink) {			\
+      fuse_reply_err(req, ENOTSUP);		\
+      return;					\
+    }						\
+  } while(0)
+
+/* reply to getxattr/listxattr, which share the same conventions */
+static void reply_xattr(fuse_req_t req, const char* buf, size_t size,
+			ssize_t result)
+{
+  if (-1 == result) {
+    fuse_reply_err(req, errno);
+  } else if (size == 0) {
+    fuse_reply_xattr(req, result);
+  } else {
+    fuse_reply_buf(req, buf, result);
+  }
+}
+
+void sandbox_ll_getxattr(fuse_req_t req, fuse_ino_t ino, const char* name,
+			 size_t size)
+{
+  STATS_TIMER(STATS_GETXATTR);
+  Inode& inode = get_inode(ino);
+  CHECK_NOT_SYMLINK(req, inode);
+  PROC_PATH(procpath, inode);
+
+  char* buf = size ? (char*)malloc(size) : 0;
+  if (size && !buf) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+  reply_xattr(req, buf, size, getxattr(procpath, name, buf, size));
+  free(buf);
+}
+
+void sandbox_ll_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
+{
+  STATS_TIMER(STATS_LISTXATTR);
+  Inode& inode = get_inode(ino);
+  CHECK_NOT_SYMLINK(req, inode);
+  PROC_PATH(procpath, inode);
+
+  char* buf = size ? (char*)malloc(size) : 0;
+  if (size && !buf) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+  reply_xattr(req, buf, size, listxattr(procpath, buf, size));
+  free(buf);
+}
+
+void sandbox_ll_setxattr(fuse_req_t req, fuse_ino_t ino, const char* name,
+			 const char* value, size_t size, int flags)
+{
+  STATS_TIMER(STATS_SETXATTR);
+  Inode& inode = get_inode(ino);
+  CHECK_ACCESS(req, inode.cursor, 1, inode.fd, 0);
+  CHECK_NOT_SYMLINK(req, inode);
+  PROC_PATH(procpath, inode);
+  REPLY_ERRNO(req, setxattr(procpath, name, value, size, flags));
+  fuse_reply_err(req, 0);
+}
+
+void sandbox_ll_removexattr(fuse_req_t req, fuse_ino_t ino, const char* name)
+{
+  STATS_TIMER(STATS_REMOVEXATTR);
+  Inode& inode = get_inode(ino);
+  CHECK_ACCESS(req, inode.cursor, 1, inode.fd, 0);
+  CHECK_NOT_SYMLINK(req, inode);
+  PROC_PATH(procpath, inode);
+  REPLY_ERRNO(req, removexattr(procpath, name));
+  fuse_reply_err(req, 0);
+}
+
+int run_fuse_inode_sandbox(int argc, char** argv, const Context* ctx,
+			   const Policy* sandbox_policy, int statusfd)
+{
+  policy = sandbox_policy;
+  context = ctx;
+  fs_cache = ctx->fs_cache;
+
+  switch (fs_cache) {
+  case FS_CACHE_NONE:
+    entry_timeout = attr_timeout = 1;
+    negative_timeout = 0;
+    break;
+  case FS_CACHE_AGGRESSIVE:
+    entry_timeout = attr_timeout = negative_timeout = 60;
+    break;
+  default:
+    entry_timeout = attr_timeout = negative_timeout = 1;
+    break;
+  }
+
+  root.fd = open("/", O_PATH|O_CLOEXEC);
+  if (root.fd == -1) {
+    perror("fuse: open /");
+    return 1;
+  }
+  root.cursor = policy->root();
+
+  struct fuse_lowlevel_ops oper{};
+  oper.access = sandbox_ll_access;
+  oper.create = sandbox_ll_create;
+  oper.flush = sandbox_ll_flush;
+  oper.forget = sandbox_ll_forget;
+  oper.forget_multi = sandbox_ll_forget_multi;
+  oper.fsync = sandbox_ll_fsync;
+  oper.getattr = sandbox_ll_getattr;
+  oper.getxattr = sandbox_ll_getxattr;
+  oper.init = sandbox_ll_init;
+  oper.link = sandbox_ll_link;
+  oper.listxattr = sandbox_ll_listxattr;
+  oper.lookup = sandbox_ll_lookup;
+  oper.mkdir = sandbox_ll_mkdir;
+  oper.mknod = sandbox_ll_mknod;
+  oper.open = sandbox_ll_open;
+  oper.opendir = sandbox_ll_opendir;
+  oper.read = sandbox_ll_read;
+  oper.readdir = sandbox_ll_readdir;
+  oper.readdirplus = sandbox_ll_readdirplus;
+  oper.readlink = sandbox_ll_readlink;
+  oper.release = sandbox_ll_release;
+  oper.releasedir = sandbox_ll_releasedir;
+  oper.removexattr = sandbox_ll_removexattr;
+  oper.rename = sandbox_ll_rename;
+  oper.rmdir = sandbox_ll_rmdir;
+  oper.setattr = sandbox_ll_setattr;
+  oper.setxattr = sandbox_ll_setxattr;
+  oper.statfs = sandbox_ll_statfs;
+  oper.symlink = sandbox_ll_symlink;
+  oper.unlink = sandbox_ll_unlink;
+  oper.write = sandbox_ll_write;
+  oper.write_buf = sandbox_ll_write_buf;
+
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  struct fuse_cmdline_opts opts;
+  if (-1 == fuse_parse_cmdline(&args, &opts)) {
+    return 1;
+  }
+
+  int result = 1;
+  struct fuse_session* se = fuse_session_new(&args, &oper, sizeof(oper),
+					     &statusfd);
+  if (se) {
+    if (-1 != fuse_set_signal_handlers(se)) {
+      trace_begin("mount");
+      int mounted = fuse_session_mount(se, opts.mountpoint);
+      trace_end("mount");
+      if (-1 != mounted) {
+	if (opts.singlethread) {
+	  result = fuse_session_loop(se);
+	} else {
+#if FUSE_USE_VERSION >= 312
+	  struct fuse_loop_config* config = fuse_loop_cfg_create();
+	  fuse_loop_cfg_set_clone_fd(config, opts.clone_fd);
+	  fuse_loop_cfg_set_idle_threads(config, opts.max_idle_threads);
+	  fuse_loop_cfg_set_max_threads(config, opts.max_threads);
+	  result = fuse_session_loop_mt(se, config);
+	  fuse_loop_cfg_destroy(config);
+#else
+	  struct fuse_loop_config config;
+	  config.clone_fd = opts.clone_fd;
+	  config.max_idle_threads = opts.max_idle_threads;
+	  result = fuse_session_loop_mt(se, &config);
+#endif
+	}
+	fuse_session_unmount(se);
+      }
+      fuse_remove_signal_handlers(se);
+    }
+    fuse_session_destroy(se);
+  }
+
+  free(opts.mountpoint);
+  fuse_opt_free_args(&args);
+  return result ? 1 : 0;
+}
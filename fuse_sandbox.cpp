@@ -21,14 +21,19 @@
   WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 */
 
-#define FUSE_USE_VERSION 26
+/* normally set by the Makefile according to the installed libfuse */
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 35
+#endif
 #define _BSD_SOURCE
 #define _XOPEN_SOURCE 500
 
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/stat.h>
-#include <fuse/fuse.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <stdint.h>
 #include <assert.h>
 #include <sys/prctl.h>
 #include <stdlib.h>
@@ -41,48 +46,85 @@
 #include <unistd.h>
 #include <sys/xattr.h>
 
-#include <list>
-
 #include "shared.h"
+#include "attr_cache.h"
+#include "audit.h"
+#include "cgroup.h"
+#include "content_cache.h"
 #include "fuse_sandbox.h"
-#include "path.h"
+#include "fuse_inode_sandbox.h"
+#include "policy.h"
+#include "read_trace.h"
+#include "report.h"
+#include "stats.h"
+#include "trace.h"
+#include "uring.h"
+
+/*
+  One mount of the sandbox filesystem, passed to libfuse as private_data.
+  A sandbox's FUSE process serves one; a --fs-daemon serves one for each
+  sandbox, all sharing the attribute cache below.
+*/
+struct Session {
+  Policy policy;
+  Context context;
+  int statusfd;           /* until init has been reported */
+  bool writeback_cache;
+};
+
+/*
+  An open file. Small files opened only for reading, outside of the
+  writable paths, are read in full into the content cache when opened.
+*/
+struct FileHandle {
+  int fd;
+  ContentCache::Content content;
+};
 
-static Path mountpoint;
-static std::list<Path> writable_paths;
+static AttrCache attr_cache;
+static ContentCache content_cache;
+static ReadTrace read_trace;
+static bool use_uring;
 
-/* returns 1 if path should be hidden in the sandbox */
-int should_hide(const char* path)
+static void write_read_trace()
 {
-  return (0 == strncmp(path, mountpoint.path().c_str(), mountpoint.length()));
+  read_trace.write();
 }
 
-/* returns 1 if write access under the given path should not be blocked */
-int permit_write(const char* path)
+static Session* get_session()
 {
-  for (Path tree : writable_paths) {
-    if (0 == strncmp(path, (tree.path()+"/").c_str(), tree.length()+1)
-	&& strlen(path) > tree.length()+1) {
-      return 1;
-    }
-  }
-  return 0;
+  return reinterpret_cast<Session*>(fuse_get_context()->private_data);
 }
 
-#define CHECK_READ(path)			\
-  do {						\
-    if (should_hide(path)) {			\
-      return -ENOENT;				\
-    }						\
+static FileHandle* get_file(struct fuse_file_info* fi)
+{
+  return reinterpret_cast<FileHandle*>(uintptr_t(fi->fh));
+}
+
+static void audit_write(int op, const char* path, int result)
+{
+  audit_record(op, path, fuse_get_context()->pid, result);
+}
+
+#define CHECK_READ(path)				\
+  do {							\
+    int denied = get_session()->policy.check(path, 0);	\
+    if (denied) {					\
+      read_trace.record(path, denied);			\
+      return denied;					\
+    }							\
   } while(0)
 
-#define CHECK_READWRITE(path)			\
-  do {						\
-    if (should_hide(path)) {			\
-      return -ENOENT;				\
-    }						\
-    if (!permit_write(path)) {			\
-      return -EACCES;				\
-    }						\
+/* audited as the operation of the enclosing STATS_TIMER */
+#define CHECK_READWRITE(path)				\
+  do {							\
+    int denied = get_session()->policy.check(path, 1);	\
+    if (audit_wanted(denied)) {				\
+      audit_write(stats_timer.op, path, denied);	\
+    }							\
+    if (denied) {					\
+      return denied;					\
+    }							\
   } while(0)
 
 #define PROXY(...)				\
@@ -96,260 +138,792 @@ int permit_write(const char* path)
 
 int sandbox_access(const char* path, int mode)
 {
+  STATS_TIMER(STATS_ACCESS);
   CHECK_READ(path);
-  return PROXY(access(path, mode));
+  int result = PROXY(access(path, mode));
+  read_trace.record(path, result);
+  return result;
 }
 
 int sandbox_mknod(const char* path, mode_t mode, dev_t dev)
 {
+  STATS_TIMER(STATS_MKNOD);
   CHECK_READWRITE(path);
-  return PROXY(mknod(path, mode, dev));
+  int result = PROXY(mknod(path, mode, dev));
+  attr_cache.invalidate(path);
+  return result;
 }
 
 int sandbox_readlink(const char* path, char* buf, size_t size)
 {
+  STATS_TIMER(STATS_READLINK);
   CHECK_READ(path);
   int result = readlink(path, buf, size-1);
   if (-1 == result) {
-    return -errno;
+    result = -errno;
+    read_trace.record(path, result);
+    return result;
   }
+  read_trace.record(path, 0);
   buf[result] = 0;
   return 0;
 }
 
-int sandbox_getattr(const char* path, struct stat* statbuf)
+int sandbox_getattr(const char* path, struct stat* statbuf,
+		    struct fuse_file_info* fi)
 {
+  STATS_TIMER(STATS_GETATTR);
   CHECK_READ(path);
-  return PROXY(lstat(path, statbuf));
+
+  /* with the writeback cache, the kernel's view of an open file wins */
+  if (fi) {
+    return PROXY(fstat(get_file(fi)->fd, statbuf));
+  }
+
+  int result;
+  uint64_t generation;
+  if (!attr_cache.lookup(path, statbuf, &result, &generation)) {
+    result = PROXY(lstat(path, statbuf));
+    if (!result || result == -ENOENT) {
+      attr_cache.insert(path, statbuf, result, generation);
+    }
+  }
+  read_trace.record(path, result);
+  return result;
 }
 
 /* things which need access control */
 int sandbox_unlink(const char* path)
 {
+  STATS_TIMER(STATS_UNLINK);
   CHECK_READWRITE(path);
-  return PROXY(unlink(path));
+  int result = PROXY(unlink(path));
+  attr_cache.invalidate(path);
+  return result;
 }
 
 int sandbox_mkdir(const char* path, mode_t mode)
 {
+  STATS_TIMER(STATS_MKDIR);
   CHECK_READWRITE(path);
-  return PROXY(mkdir(path, mode));
+  int result = PROXY(mkdir(path, mode));
+  attr_cache.invalidate(path);
+  return result;
 }
 
 int sandbox_rmdir(const char* path)
 {
+  STATS_TIMER(STATS_RMDIR);
   CHECK_READWRITE(path);
-  return PROXY(rmdir(path));
+  int result = PROXY(rmdir(path));
+  attr_cache.invalidate(path);
+  return result;
 }
 
 int sandbox_symlink(const char* oldpath, const char* newpath)
 {
+  STATS_TIMER(STATS_SYMLINK);
   CHECK_READWRITE(newpath);
-  return PROXY(symlink(oldpath, newpath));
+  int result = PROXY(symlink(oldpath, newpath));
+  attr_cache.invalidate(newpath);
+  return result;
 }
 
-int sandbox_rename(const char* oldpath, const char* newpath)
+int sandbox_rename(const char* oldpath, const char* newpath,
+		   unsigned int flags)
 {
+  STATS_TIMER(STATS_RENAME);
   CHECK_READWRITE(oldpath);
   CHECK_READWRITE(newpath);
-  return PROXY(rename(oldpath, newpath));
+  int result = flags
+    ? PROXY(renameat2(AT_FDCWD, oldpath, AT_FDCWD, newpath, flags))
+    : PROXY(rename(oldpath, newpath));
+  attr_cache.invalidate_tree(oldpath);
+  attr_cache.invalidate_tree(newpath);
+  return result;
 }
 
 int sandbox_link(const char* oldpath, const char* newpath)
 {
+  STATS_TIMER(STATS_LINK);
   CHECK_READWRITE(newpath);
-  return PROXY(link(oldpath, newpath));
+  int result = PROXY(link(oldpath, newpath));
+  attr_cache.invalidate(oldpath);
+  attr_cache.invalidate(newpath);
+  return result;
 }
 
-int sandbox_chmod(const char* path, mode_t mode)
+int sandbox_chmod(const char* path, mode_t mode, struct fuse_file_info* fi)
 {
+  STATS_TIMER(STATS_CHMOD);
   CHECK_READWRITE(path);
-  return PROXY(chmod(path, mode));
+  int result = PROXY(chmod(path, mode));
+  attr_cache.invalidate(path);
+  return result;
 }
 
-int sandbox_chown(const char* path, uid_t uid, gid_t gid)
+int sandbox_chown(const char* path, uid_t uid, gid_t gid,
+		  struct fuse_file_info* fi)
 {
+  STATS_TIMER(STATS_CHOWN);
   CHECK_READWRITE(path);
-  return PROXY(chown(path, uid, gid));
+  int result = PROXY(chown(path, uid, gid));
+  attr_cache.invalidate(path);
+  return result;
 }
 
-int sandbox_truncate(const char* path, off_t off)
+int sandbox_truncate(const char* path, off_t off, struct fuse_file_info* fi)
 {
+  STATS_TIMER(STATS_TRUNCATE);
   CHECK_READWRITE(path);
-  return PROXY(truncate(path, off));
+  int result = PROXY(fi
+		     ? ftruncate(get_file(fi)->fd, off)
+		     : truncate(path, off));
+  attr_cache.invalidate(path);
+  return result;
 }
 
 int sandbox_open(const char* path, struct fuse_file_info* fi)
 {
+  STATS_TIMER(STATS_OPEN);
+  Session* session = get_session();
   int flags = fi->flags;
-  if (flags&O_WRONLY || flags&O_RDWR || flags&O_TRUNC) {
-    CHECK_READWRITE(path);
-  } else {
-    CHECK_READ(path);
+  int write = flags&O_WRONLY || flags&O_RDWR || flags&O_TRUNC;
+  Policy::Cursor cursor = session->policy.lookup(path);
+  int denied = Policy::check(cursor, write);
+  if (write && audit_wanted(denied)) {
+    audit_write(STATS_OPEN, path, denied);
+  }
+  if (denied) {
+    read_trace.record(path, denied);
+    return denied;
   }
 
-  int fd = open(path, fi->flags);
+  int fd = open(path, fuse_sandbox_open_flags(flags,
+					      session->writeback_cache));
+  if (flags&O_TRUNC) {
+    attr_cache.invalidate(path);
+  }
   if (-1 == fd) {
-    return -errno;
+    int result = -errno;
+    read_trace.record(path, result);
+    return result;
   }
-  close(fd);
+  read_trace.record(path, 0);
+
+  FileHandle* file = new FileHandle;
+  file->fd = fd;
+  struct stat st;
+  if (content_cache.enabled() && !write
+      && !(cursor.flags & Policy::WRITABLE) && 0 == fstat(fd, &st)) {
+    file->content = content_cache.get(fd, st);
+  }
+  fi->fh = uintptr_t(file);
   return 0;
 }
 
-int sandbox_read(const char* path, char* buf, size_t size, off_t off,
-		 struct fuse_file_info* fi)
+int sandbox_create(const char* path, mode_t mode, struct fuse_file_info* fi)
 {
-  CHECK_READ(path);
+  STATS_TIMER(STATS_CREATE);
+  CHECK_READWRITE(path);
 
-  /* NOTE: requires direct_io mounting */
-  int fd = open(path, O_RDONLY);
-  if (fd == -1) {
+  int fd = open(path, fuse_sandbox_open_flags(fi->flags,
+					      get_session()->writeback_cache),
+		mode);
+  attr_cache.invalidate(path);
+  if (-1 == fd) {
     return -errno;
   }
+  FileHandle* file = new FileHandle;
+  file->fd = fd;
+  fi->fh = uintptr_t(file);
+  return 0;
+}
 
-  ssize_t out = pread(fd, buf, size, off);
-  close(fd);
-
-  if (-1 == out) {
-    return -errno;
+/* read from cached file contents; returns the number of bytes read */
+static size_t read_content(std::string const& content, char* buf,
+			   size_t size, off_t off)
+{
+  if (off >= (off_t)content.size()) {
+    return 0;
   }
-  return out;
+  size_t available = content.size() - off;
+  if (size > available) {
+    size = available;
+  }
+  memcpy(buf, content.data() + off, size);
+  return size;
 }
 
-int sandbox_statfs(const char* path, struct statvfs* fs)
+/*
+  read and write use the file opened in sandbox_open/sandbox_create;
+  access was checked at that point.
+*/
+int sandbox_read(const char* path, char* buf, size_t size, off_t off,
+		 struct fuse_file_info* fi)
 {
-  CHECK_READ(path);
-  return PROXY(statvfs(path, fs));
+  STATS_TIMER(STATS_READ);
+  FileHandle* file = get_file(fi);
+  int result = file->content
+    ? (int)read_content(*file->content, buf, size, off)
+    : PROXY(pread(file->fd, buf, size, off));
+  STATS_BYTES(result);
+  return result;
 }
 
 int sandbox_write(const char* path, const char* buf, size_t size,
 		  off_t off, struct fuse_file_info* fi)
 {
-  CHECK_READWRITE(path);
+  STATS_TIMER(STATS_WRITE);
+  int result = PROXY(pwrite(get_file(fi)->fd, buf, size, off));
+  attr_cache.invalidate(path);
+  STATS_BYTES(result);
+  return result;
+}
 
-  int fd = open(path, O_WRONLY);
-  if (fd == -1) {
-    return -errno;
+/*
+  Zero-copy variants of read and write: rather than copying data through
+  a buffer in this process, hand libfuse a buffer referring to our fd so
+  that data may be spliced between the file and /dev/fuse. libfuse falls
+  back to copying if the kernel or the underlying filesystem can't splice.
+  Cached contents are copied into a buffer, which libfuse frees.
+*/
+int sandbox_read_buf(const char* path, struct fuse_bufvec** bufp, size_t size,
+		     off_t off, struct fuse_file_info* fi)
+{
+  STATS_TIMER(STATS_READ);
+  FileHandle* file = get_file(fi);
+  struct fuse_bufvec* src = (struct fuse_bufvec*)malloc(sizeof(*src));
+  if (!src) {
+    return -ENOMEM;
   }
 
-  ssize_t wrote = pwrite(fd, buf, size, off);
-  int wrote_errno = errno;
-  int closed = close(fd);
-
-  if (-1 == wrote) {
-    return -wrote_errno;
+  if (file->content) {
+    char* mem = (char*)malloc(size ? size : 1);
+    if (!mem) {
+      free(src);
+      return -ENOMEM;
+    }
+    size = read_content(*file->content, mem, size, off);
+    *src = FUSE_BUFVEC_INIT(size);
+    src->buf[0].mem = mem;
+    STATS_BYTES(size);
+  } else {
+    *src = FUSE_BUFVEC_INIT(size);
+    src->buf[0].flags = (enum fuse_buf_flags)(FUSE_BUF_IS_FD|FUSE_BUF_FD_SEEK);
+    src->buf[0].fd = file->fd;
+    src->buf[0].pos = off;
+    if (stats_enabled) {
+      STATS_BYTES(fuse_sandbox_read_length(file->fd, size, off));
+    }
   }
+  *bufp = src;
+  return 0;
+}
 
-#if 0
-  /*
-    FIXME: do something about this.
-    With the current implementation, we can't report the error here without
-    sometimes incorrectly reporting to the caller that we didn't write any
-    bytes.
-  */
-  if (-1 == closed) {
-    return -errno;
+int sandbox_write_buf(const char* path, struct fuse_bufvec* buf, off_t off,
+		      struct fuse_file_info* fi)
+{
+  STATS_TIMER(STATS_WRITE);
+  struct fuse_bufvec dst = FUSE_BUFVEC_INIT(fuse_buf_size(buf));
+  dst.buf[0].flags = (enum fuse_buf_flags)(FUSE_BUF_IS_FD|FUSE_BUF_FD_SEEK);
+  dst.buf[0].fd = get_file(fi)->fd;
+  dst.buf[0].pos = off;
+  ssize_t result = fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
+  attr_cache.invalidate(path);
+  STATS_BYTES(result);
+  return result;
+}
+
+/*
+  flush is called on each close() of a file descriptor in the sandbox.
+  Closing a duplicate of our fd allows errors from close() (e.g. from
+  network filesystems) to be reported to the caller.
+*/
+int sandbox_flush(const char* path, struct fuse_file_info* fi)
+{
+  STATS_TIMER(STATS_FLUSH);
+  return PROXY(close(dup(get_file(fi)->fd)));
+}
+
+int sandbox_release(const char* path, struct fuse_file_info* fi)
+{
+  STATS_TIMER(STATS_RELEASE);
+  FileHandle* file = get_file(fi);
+  close(file->fd);
+  delete file;
+  return 0;
+}
+
+int sandbox_fsync(const char* path, int datasync, struct fuse_file_info* fi)
+{
+  STATS_TIMER(STATS_FSYNC);
+  if (datasync) {
+    return PROXY(fdatasync(get_file(fi)->fd));
   }
-#else
-  (void)closed;
-#endif
+  return PROXY(fsync(get_file(fi)->fd));
+}
 
-  return wrote;
+int sandbox_statfs(const char* path, struct statvfs* fs)
+{
+  STATS_TIMER(STATS_STATFS);
+  CHECK_READ(path);
+  return PROXY(statvfs(path, fs));
+}
+
+/*
+  An open directory. The position of the last entry returned is kept so
+  that a listing continued from where it left off doesn't need a seekdir.
+*/
+struct DirHandle {
+  DIR* dir;
+  off_t offset;
+  struct dirent* entry;   /* read, but not yet returned to the kernel */
+  Policy::Cursor cursor;
+};
+
+static DirHandle* get_dir(struct fuse_file_info* fi)
+{
+  return reinterpret_cast<DirHandle*>(uintptr_t(fi->fh));
 }
 
 int sandbox_opendir(const char* path, struct fuse_file_info* fi)
 {
-  CHECK_READ(path);
+  STATS_TIMER(STATS_OPENDIR);
+  Policy::Cursor cursor = get_session()->policy.lookup(path);
+  int denied = Policy::check(cursor, 0);
+  if (denied) {
+    read_trace.record(path, denied);
+    return denied;
+  }
 
   DIR* dir = opendir(path);
   if (!dir) {
-    return -errno;
+    int result = -errno;
+    read_trace.record(path, result);
+    return result;
   }
-  closedir(dir);
+  read_trace.record_listing(path);
+
+  DirHandle* handle = new DirHandle;
+  handle->dir = dir;
+  handle->offset = 0;
+  handle->entry = 0;
+  handle->cursor = cursor;
+  fi->fh = uintptr_t(handle);
   return 0;
 }
 
+/*
+  readdirplus with the lstat() of each entry batched through io_uring
+  (--fs-uring). Entries which are stat'ed but don't fit in the buffer are
+  read again, after a seekdir, on the next call.
+*/
+static int readdirplus_uring(const Policy& policy, DirHandle* handle,
+			     void* buf, fuse_fill_dir_t filler)
+{
+  struct Entry {
+    char name[sizeof(((struct dirent*)0)->d_name)];
+    ino_t ino;
+    unsigned char type;
+    off_t offset;
+    off_t nextoff;
+  };
+  Entry entries[URING_BATCH];
+  const char* names[URING_BATCH];
+  struct stat st[URING_BATCH];
+  int results[URING_BATCH];
+  int filled = 0;
+
+  for (;;) {
+    size_t count = 0;
+    int done = 0;
+    int error = 0;
+    while (count < URING_BATCH) {
+      if (!handle->entry) {
+	errno = 0;
+	handle->entry = readdir(handle->dir);
+	if (!handle->entry) {
+	  error = errno;
+	  done = 1;
+	  break;
+	}
+      }
+
+      struct dirent* ent = handle->entry;
+      off_t nextoff = telldir(handle->dir);
+      size_t len = strlen(ent->d_name);
+      if (handle->cursor.node == -1
+	  || !(policy.step(handle->cursor, ent->d_name, len).flags
+	       & Policy::HIDDEN)) {
+	Entry& entry = entries[count];
+	memcpy(entry.name, ent->d_name, len + 1);
+	entry.ino = ent->d_ino;
+	entry.type = ent->d_type;
+	entry.offset = handle->offset;
+	entry.nextoff = nextoff;
+	names[count++] = entry.name;
+      }
+
+      handle->entry = 0;
+      handle->offset = nextoff;
+    }
+
+    if (count) {
+      uring_lstat(dirfd(handle->dir), names, count, st, results);
+    }
+    for (size_t i = 0; i < count; ++i) {
+      Entry& entry = entries[i];
+      enum fuse_fill_dir_flags fill = (enum fuse_fill_dir_flags)0;
+      if (!results[i]) {
+	fill = FUSE_FILL_DIR_PLUS;
+      } else {
+	memset(&st[i], 0, sizeof(st[i]));
+	st[i].st_ino = entry.ino;
+	st[i].st_mode = DTTOIF(entry.type);
+      }
+      if (filler(buf, entry.name, &st[i], entry.nextoff, fill)) {
+	/* buffer full; continue from this entry on the next call */
+	seekdir(handle->dir, entry.offset);
+	handle->offset = entry.offset;
+	return 0;
+      }
+      filled = 1;
+    }
+
+    if (done) {
+      /* report errors only if there's nothing else to report */
+      return filled ? 0 : -error;
+    }
+  }
+}
+
 int sandbox_readdir(const char* path, void* buf, fuse_fill_dir_t filler,
-		    off_t off, struct fuse_file_info* fi)
+		    off_t off, struct fuse_file_info* fi,
+		    enum fuse_readdir_flags flags)
 {
-  CHECK_READ(path);
+  STATS_TIMER(flags & FUSE_READDIR_PLUS ? STATS_READDIRPLUS : STATS_READDIR);
+  const Policy& policy = get_session()->policy;
+  DirHandle* handle = get_dir(fi);
+
+  if (off != handle->offset) {
+    seekdir(handle->dir, off);
+    handle->entry = 0;
+    handle->offset = off;
+  }
 
-  DIR* dir = opendir(path);
-  if (!dir) {
-    return -errno;
+  if (use_uring && (flags & FUSE_READDIR_PLUS)) {
+    return readdirplus_uring(policy, handle, buf, filler);
   }
 
-  int hide_mountpoint = (mountpoint.dirname() == path);
-  struct dirent* ent;
+  int filled = 0;
+  for (;;) {
+    if (!handle->entry) {
+      errno = 0;
+      handle->entry = readdir(handle->dir);
+      if (!handle->entry) {
+	/* report errors only if there's nothing else to report */
+	return filled ? 0 : -errno;
+      }
+    }
 
-  while ((ent = readdir(dir))) {
-    if (hide_mountpoint && mountpoint.basename() == ent->d_name) {
-      continue;
+    struct dirent* ent = handle->entry;
+    off_t nextoff = telldir(handle->dir);
+
+    if (handle->cursor.node == -1
+	|| !(policy.step(handle->cursor, ent->d_name,
+			 strlen(ent->d_name)).flags & Policy::HIDDEN)) {
+      struct stat st{};
+      enum fuse_fill_dir_flags fill = (enum fuse_fill_dir_flags)0;
+      if ((flags & FUSE_READDIR_PLUS)
+	  && 0 == fstatat(dirfd(handle->dir), ent->d_name, &st,
+			  AT_SYMLINK_NOFOLLOW)) {
+	fill = FUSE_FILL_DIR_PLUS;
+      } else {
+	st.st_ino = ent->d_ino;
+	st.st_mode = DTTOIF(ent->d_type);
+      }
+      if (filler(buf, ent->d_name, &st, nextoff, fill)) {
+	/* buffer full; this entry is returned on the next call */
+	break;
+      }
+      filled = 1;
     }
-    struct stat st{};
-    st.st_ino = ent->d_ino;
-    st.st_mode = ent->d_type << 12;
-    if (filler(buf, ent->d_name, &st, 0))
-      break;
+
+    handle->entry = 0;
+    handle->offset = nextoff;
   }
 
-  closedir(dir);
+  return 0;
+}
+
+int sandbox_releasedir(const char* path, struct fuse_file_info* fi)
+{
+  STATS_TIMER(STATS_RELEASEDIR);
+  DirHandle* handle = get_dir(fi);
+  closedir(handle->dir);
+  delete handle;
   return 0;
 }
 
 int sandbox_setxattr(const char* path, const char* name, const char* value,
 		     size_t size, int flags)
 {
+  STATS_TIMER(STATS_SETXATTR);
   CHECK_READWRITE(path);
-  return PROXY(lsetxattr(path, name, value, size, flags));
+  int result = PROXY(lsetxattr(path, name, value, size, flags));
+  attr_cache.invalidate(path);
+  return result;
 }
 
 int sandbox_getxattr(const char* path, const char* name, char* value,
 		     size_t size)
 {
+  STATS_TIMER(STATS_GETXATTR);
   CHECK_READ(path);
   return PROXY(lgetxattr(path, name, value, size));
 }
 
 int sandbox_listxattr(const char* path, char* list, size_t size)
 {
+  STATS_TIMER(STATS_LISTXATTR);
   CHECK_READ(path);
   return PROXY(llistxattr(path, list, size));
 }
 
 int sandbox_removexattr(const char* path, const char* name)
 {
+  STATS_TIMER(STATS_REMOVEXATTR);
   CHECK_READWRITE(path);
-  return PROXY(lremovexattr(path, name));
+  int result = PROXY(lremovexattr(path, name));
+  attr_cache.invalidate(path);
+  return result;
 }
 
-int sandbox_utimens(const char* path, const struct timespec tv[2])
+int sandbox_utimens(const char* path, const struct timespec tv[2],
+		    struct fuse_file_info* fi)
 {
+  STATS_TIMER(STATS_UTIMENS);
   CHECK_READWRITE(path);
-  int fd = open(path, O_WRONLY);
-  if (fd == -1) {
-    return -errno;
-  }
-  int out = futimens(fd, tv);
-  int out_errno = errno;
+  int result = PROXY(fi
+		     ? futimens(get_file(fi)->fd, tv)
+		     : utimensat(AT_FDCWD, path, tv, AT_SYMLINK_NOFOLLOW));
+  attr_cache.invalidate(path);
+  return result;
+}
 
-  close(fd);
+bool fuse_sandbox_init(struct fuse_conn_info* conn, const Context* ctx,
+		       int statusfd)
+{
+  bool writeback_cache = false;
 
-  if (-1 == out) {
-    return -out_errno;
+  /* use splice for data transfer where the kernel supports it */
+  conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ|FUSE_CAP_SPLICE_WRITE);
+
+  if (ctx->fs_max_background) {
+    conn->max_background = ctx->fs_max_background;
   }
-  return 0;
-}
 
-void* sandbox_init(struct fuse_conn_info* conn)
-{
+  /* --fs-opt; pointless with --fs-cache=none, which bypasses the cache */
+  if (ctx->fs_writeback_cache && ctx->fs_cache != FS_CACHE_NONE) {
+    if (conn->capable & FUSE_CAP_WRITEBACK_CACHE) {
+      conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+      writeback_cache = true;
+    } else {
+      fprintf(stderr, "warning: the kernel doesn't support the FUSE "
+	      "writeback cache; ignored\n");
+    }
+  }
+  if (ctx->fs_max_write) {
+    conn->max_write = ctx->fs_max_write;
+  }
+  if (ctx->fs_max_read) {
+    conn->max_read = ctx->fs_max_read;
+  }
+  /* the kernel only accepts a readahead no larger than it offered */
+  if (ctx->fs_max_readahead && ctx->fs_max_readahead < conn->max_readahead) {
+    conn->max_readahead = ctx->fs_max_readahead;
+  }
+  debug("fuse init: max_write %u, max_read %u, max_readahead %u%s\n",
+	conn->max_write, conn->max_read, conn->max_readahead,
+	writeback_cache ? ", writeback cache" : "");
+
+  trace_instant("init");
+
   /* let parent know the filesystem has been initialized OK */
-  int statusfd = *((int*)fuse_get_context()->private_data);
   int status = 0;
   write(statusfd, &status, sizeof(status));
   close(statusfd);
   debug("fuse init: notified parent\n");
-  return 0;
+  return writeback_cache;
+}
+
+int fuse_sandbox_open_flags(int flags, bool writeback_cache)
+{
+  if (writeback_cache) {
+    /*
+      The kernel may read from a file opened only for writing, to fill the
+      rest of a page being written; and it handles O_APPEND itself, giving
+      the offsets to write at.
+    */
+    if ((flags & O_ACCMODE) == O_WRONLY) {
+      flags = (flags & ~O_ACCMODE) | O_RDWR;
+    }
+    flags &= ~O_APPEND;
+  }
+  return flags;
+}
+
+size_t fuse_sandbox_read_length(int fd, size_t size, off_t off)
+{
+  struct stat st;
+  if (fstat(fd, &st) || !S_ISREG(st.st_mode) || off >= st.st_size) {
+    return 0;
+  }
+  return size < size_t(st.st_size - off) ? size : st.st_size - off;
+}
+
+void* sandbox_init(struct fuse_conn_info* conn, struct fuse_config* cfg)
+{
+  Session* session = get_session();
+
+  /* set up caching according to --fs-cache */
+  switch (session->context.fs_cache) {
+  case FS_CACHE_NONE:
+    cfg->direct_io = 1;
+    break;
+  case FS_CACHE_AGGRESSIVE:
+    cfg->kernel_cache = 1;
+    cfg->entry_timeout = cfg->negative_timeout = cfg->attr_timeout = 60;
+    break;
+  default:
+    cfg->auto_cache = 1;
+    cfg->entry_timeout = cfg->negative_timeout = cfg->attr_timeout = 1;
+    break;
+  }
+
+  session->writeback_cache = fuse_sandbox_init(conn, &session->context,
+					       session->statusfd);
+  session->statusfd = -1;
+  return session;
+}
+
+/* seconds to cache attributes in this process (--fs-attr-cache-ttl) */
+static double attr_cache_ttl(const Context* ctx)
+{
+  if (ctx->fs_attr_cache_ttl >= 0) {
+    return ctx->fs_attr_cache_ttl;
+  }
+  /* by default, as long as the kernel caches them */
+  switch (ctx->fs_cache) {
+  case FS_CACHE_NONE:
+    return 0;
+  case FS_CACHE_AGGRESSIVE:
+    return 60;
+  default:
+    return 1;
+  }
+}
+
+/* options for libfuse's mount and multi-threaded loop, as a -o argument */
+std::string loop_options(const Context* ctx)
+{
+  /* one /dev/fuse fd per worker thread */
+  std::string out = "clone_fd";
+  char buf[64];
+
+  if (ctx->fs_max_idle_threads >= 0) {
+    snprintf(buf, sizeof(buf), ",max_idle_threads=%d",
+	     ctx->fs_max_idle_threads);
+    out += buf;
+  }
+
+  if (ctx->fs_max_read) {
+    /* libfuse needs this as a mount option, too */
+    snprintf(buf, sizeof(buf), ",max_read=%u", ctx->fs_max_read);
+    out += buf;
+  }
+
+  if (ctx->fs_threads) {
+#if FUSE_USE_VERSION >= 312
+    snprintf(buf, sizeof(buf), ",max_threads=%d", ctx->fs_threads);
+    out += buf;
+#else
+    fprintf(stderr, "warning: --fs-threads requires libfuse 3.12 or later; "
+	    "ignored\n");
+#endif
+  }
+
+  return out;
+}
+
+/* the policy and options of one sandbox; see struct Session */
+static Session* new_session(const Context* ctx, int statusfd)
+{
+  Session* session = new Session;
+  session->context = *ctx;
+  session->statusfd = statusfd;
+  session->writeback_cache = false;
+
+  session->policy.hide(ctx->fuse_mountpoint);
+  for (std::string path : ctx->fuse_writable_paths) {
+    session->policy.allow_write(path);
+    debug("fs: path %s is writable\n", path.c_str());
+  }
+  return session;
+}
+
+/* state of the path engine shared by all of its sessions */
+static void start_path_engine(const Context* ctx)
+{
+  attr_cache.start(attr_cache_ttl(ctx));
+  content_cache.start(ctx->fs_content_cache, ctx->fs_content_cache_file_max);
+  if (ctx->fs_uring) {
+    use_uring = uring_available();
+    if (!use_uring) {
+      fprintf(stderr, "warning: io_uring is not available; --fs-uring "
+	      "ignored\n");
+    }
+  }
+}
+
+static struct fuse_operations path_operations()
+{
+  struct fuse_operations oper{};
+  oper.access = sandbox_access;
+  oper.chmod = sandbox_chmod;
+  oper.chown = sandbox_chown;
+  oper.create = sandbox_create;
+  oper.flush = sandbox_flush;
+  oper.fsync = sandbox_fsync;
+  oper.getattr = sandbox_getattr;
+  oper.getxattr = sandbox_getxattr;
+  oper.init = sandbox_init;
+  oper.link = sandbox_link;
+  oper.listxattr = sandbox_listxattr;
+  oper.mkdir = sandbox_mkdir;
+  oper.mknod = sandbox_mknod;
+  oper.open = sandbox_open;
+  oper.opendir = sandbox_opendir;
+  oper.read = sandbox_read;
+  oper.readdir = sandbox_readdir;
+  oper.releasedir = sandbox_releasedir;
+  oper.readlink = sandbox_readlink;
+  oper.release = sandbox_release;
+  oper.removexattr = sandbox_removexattr;
+  oper.rename = sandbox_rename;
+  oper.rmdir = sandbox_rmdir;
+  oper.setxattr = sandbox_setxattr;
+  oper.statfs = sandbox_statfs;
+  oper.symlink = sandbox_symlink;
+  oper.truncate = sandbox_truncate;
+  oper.unlink = sandbox_unlink;
+  oper.utimens = sandbox_utimens;
+  oper.write = sandbox_write;
+  oper.read_buf = sandbox_read_buf;
+  oper.write_buf = sandbox_write_buf;
+
+  return oper;
 }
 
 int start_fuse_sandbox(const Context* ctx)
@@ -389,50 +963,108 @@ int start_fuse_sandbox(const Context* ctx)
   close(statusfd[0]);
 
   prctl(PR_SET_NAME, APPNAME " [fuse]");
+  trace_process("FUSE");
+  trace_instant("started");
 
-  mountpoint.set(ctx->fuse_mountpoint);
+  if (ctx->cgroup_fd != -1 && ctx->cgroup_fuse
+      && cgroup_enter(ctx->cgroup_fd)) {
+    exit(1);
+  }
 
-  for (std::string path : ctx->fuse_writable_paths) {
-    Path p{path};
-    writable_paths.push_back(p);
-    debug("fs: path (%s,%s) is writable\n", p.dirname().c_str(), p.basename().c_str());
+  Session* session = new_session(ctx, statusfd[1]);
+
+  if (ctx->fs_stats) {
+    stats_start(ctx->fs_stats_file.c_str());
+  }
+  if (!ctx->fs_audit_file.empty()
+      && audit_start(ctx->fs_audit_file.c_str(), ctx->fs_audit_allowed)) {
+    exit(1);
   }
+  report_fuse_start();
 
+  std::string options = loop_options(ctx);
   const char* argv[] = {
     APPNAME,
     ctx->fuse_mountpoint.c_str(),
-    "-o", "direct_io",
+    "-o", options.c_str(),
     Global::debug_mode > 1 ? "-d" : "-f",
     0
   };
   int argc = sizeof(argv)/sizeof(argv[0]) - 1;
 
-  struct fuse_operations oper{};
-  oper.access = sandbox_access;
-  oper.chmod = sandbox_chmod;
-  oper.chown = sandbox_chown;
-  oper.getattr = sandbox_getattr;
-  oper.getxattr = sandbox_getxattr;
-  oper.init = sandbox_init;
-  oper.link = sandbox_link;
-  oper.listxattr = sandbox_listxattr;
-  oper.mkdir = sandbox_mkdir;
-  oper.mknod = sandbox_mknod;
-  oper.open = sandbox_open;
-  oper.opendir = sandbox_opendir;
-  oper.read = sandbox_read;
-  oper.readdir = sandbox_readdir;
-  oper.readlink = sandbox_readlink;
-  oper.removexattr = sandbox_removexattr;
-  oper.rename = sandbox_rename;
-  oper.rmdir = sandbox_rmdir;
-  oper.setxattr = sandbox_setxattr;
-  oper.statfs = sandbox_statfs;
-  oper.symlink = sandbox_symlink;
-  oper.truncate = sandbox_truncate;
-  oper.unlink = sandbox_unlink;
-  oper.utimens = sandbox_utimens;
-  oper.write = sandbox_write;
+  if (ctx->fs_engine == FS_ENGINE_INODE) {
+    exit(run_fuse_inode_sandbox(argc, (char**)argv, ctx, &session->policy,
+				statusfd[1]));
+  }
+
+  start_path_engine(ctx);
+  if (!ctx->fs_trace_reads_file.empty()) {
+    read_trace.start(ctx->fs_trace_reads_file, ctx->fs_trace_hashes,
+		     &session->policy);
+    atexit(write_read_trace);
+  }
+  struct fuse_operations oper = path_operations();
+  exit(fuse_main(argc, (char**)argv, &oper, session));
+}
 
-  exit(fuse_main(argc, (char**)argv, &oper, &statusfd[1]));
+int start_fuse_daemon(const Context* ctx)
+{
+  if (ctx->fs_stats) {
+    stats_start(ctx->fs_stats_file.c_str());
+  }
+  if (!ctx->fs_audit_file.empty()
+      && audit_start(ctx->fs_audit_file.c_str(), ctx->fs_audit_allowed)) {
+    return -1;
+  }
+  start_path_engine(ctx);
+  return 0;
+}
+
+int serve_fuse_sandbox(const Context* ctx, int fuse_fd, int statusfd)
+{
+  Session* session = new_session(ctx, statusfd);
+  struct fuse_operations oper = path_operations();
+  const char* argv[] = { APPNAME, Global::debug_mode > 1 ? "-d" : 0, 0 };
+  struct fuse_args args = FUSE_ARGS_INIT(argv[1] ? 2 : 1, (char**)argv);
+
+  int result = 1;
+  struct fuse* fuse = fuse_new(&args, &oper, sizeof(oper), session);
+  if (fuse) {
+    /* libfuse takes an fd already mounted by the caller in this form */
+    char mountpoint[32];
+    snprintf(mountpoint, sizeof(mountpoint), "/dev/fd/%d", fuse_fd);
+    if (0 == fuse_mount(fuse, mountpoint)) {
+      fuse_fd = -1;
+#if FUSE_USE_VERSION >= 312
+      struct fuse_loop_config* config = fuse_loop_cfg_create();
+      fuse_loop_cfg_set_clone_fd(config, 1);
+      if (ctx->fs_max_idle_threads >= 0) {
+	fuse_loop_cfg_set_idle_threads(config, ctx->fs_max_idle_threads);
+      }
+      if (ctx->fs_threads) {
+	fuse_loop_cfg_set_max_threads(config, ctx->fs_threads);
+      }
+      result = fuse_loop_mt(fuse, config);
+      fuse_loop_cfg_destroy(config);
+#else
+      struct fuse_loop_config config;
+      config.clone_fd = 1;
+      config.max_idle_threads = ctx->fs_max_idle_threads >= 0
+	? ctx->fs_max_idle_threads : 10;
+      result = fuse_loop_mt(fuse, &config);
+#endif
+      fuse_unmount(fuse);
+    }
+    fuse_destroy(fuse);
+  }
+  fuse_opt_free_args(&args);
+
+  if (fuse_fd != -1) {
+    close(fuse_fd);
+  }
+  if (session->statusfd != -1) {
+    close(session->statusfd);
+  }
+  delete session;
+  return result ? 1 : 0;
 }
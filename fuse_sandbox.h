@@ -24,8 +24,41 @@
   WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 */
 
+#include <sys/types.h>
+
 struct Context;
+struct fuse_conn_info;
 
 int start_fuse_sandbox(const Context*);
 
+/*
+  For --fs-daemon: set up the state shared by all sandboxes served, each
+  then served by serve_fuse_sandbox() on a thread of its own. Returns -1
+  on failure.
+*/
+int start_fuse_daemon(const Context*);
+
+/*
+  For --fs-daemon: serve the path engine, with the sandbox's options in
+  ctx, on fuse_fd, a /dev/fuse fd which the sandbox has already mounted.
+  Init is reported to statusfd, as by start_fuse_sandbox(). Takes both
+  fds; returns when the filesystem is unmounted.
+*/
+int serve_fuse_sandbox(const Context* ctx, int fuse_fd, int statusfd);
+
+/*
+  common FUSE init handling; notifies statusfd of successful init.
+  Returns true if the writeback cache was enabled.
+*/
+bool fuse_sandbox_init(struct fuse_conn_info*, const Context*, int statusfd);
+
+/* flags to open the underlying file with, for flags from the kernel */
+int fuse_sandbox_open_flags(int flags, bool writeback_cache);
+
+/*
+  For --fs-stats: the bytes a read of size at off from fd returns, for a
+  read left to libfuse to splice or copy after the handler has returned.
+*/
+size_t fuse_sandbox_read_length(int fd, size_t size, off_t off);
+
 #endif
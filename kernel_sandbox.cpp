@@ -0,0 +1,439 @@
+/*
+  Copyright (c) 2012 Rohan McGovern <rohan@mcgovern.id.au>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+  LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+  Filesystem sandboxes built from mounts, with no FUSE process.
+
+  In bind mode, the whole tree is bind mounted onto the sandbox root and
+  made read-only. In overlay mode, each mount is covered by an overlay
+  which captures writes in a separate upper directory. Either way, the
+  writable trees are then bound back in with their original flags, and
+  access to files is checked by the kernel at native speed.
+*/
+
+#include "kernel_sandbox.h"
+#include "mountinfo.h"
+#include "shared.h"
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* mount_setattr(2) is not wrapped by glibc, and may be missing from headers */
+#ifndef SYS_mount_setattr
+#define SYS_mount_setattr 442
+#endif
+
+#ifndef AT_RECURSIVE
+#define AT_RECURSIVE 0x8000
+#endif
+
+#define SANDBOX_MOUNT_ATTR_RDONLY 0x00000001
+
+struct sandbox_mount_attr {
+  uint64_t attr_set;
+  uint64_t attr_clr;
+  uint64_t propagation;
+  uint64_t userns_fd;
+};
+
+/* make all mounts at or below root read-only in one call (Linux 5.12+) */
+static int set_readonly_recursive(const char* root)
+{
+  struct sandbox_mount_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.attr_set = SANDBOX_MOUNT_ATTR_RDONLY;
+  return syscall(SYS_mount_setattr, AT_FDCWD, root, AT_RECURSIVE,
+		 &attr, sizeof(attr));
+}
+
+/*
+  Flags which must be kept when remounting a bind mount, since the kernel
+  refuses to clear them on mounts locked by a user namespace.
+*/
+static unsigned long preserved_flags(const char* path)
+{
+  struct statvfs fs;
+  if (-1 == statvfs(path, &fs)) {
+    return 0;
+  }
+
+  unsigned long flags = 0;
+  if (fs.f_flag & ST_NOSUID) {
+    flags |= MS_NOSUID;
+  }
+  if (fs.f_flag & ST_NODEV) {
+    flags |= MS_NODEV;
+  }
+  if (fs.f_flag & ST_NOEXEC) {
+    flags |= MS_NOEXEC;
+  }
+  if (fs.f_flag & ST_NOATIME) {
+    flags |= MS_NOATIME;
+  }
+  if (fs.f_flag & ST_NODIRATIME) {
+    flags |= MS_NODIRATIME;
+  }
+  if (fs.f_flag & ST_RELATIME) {
+    flags |= MS_RELATIME;
+  }
+  return flags;
+}
+
+/* as set_readonly_recursive, for kernels without mount_setattr */
+static int set_readonly_each(std::string const& root)
+{
+  std::vector<MountInfo> mounts;
+  if (read_mountinfo(&mounts)) {
+    return -1;
+  }
+
+  for (MountInfo const& info : mounts) {
+    if (!path_is_under(info.mountpoint, root)) {
+      continue;
+    }
+
+    const char* path = info.mountpoint.c_str();
+    debug("fs: remounting %s read-only\n", path);
+    if (mount(0, path, 0,
+	      MS_REMOUNT|MS_BIND|MS_RDONLY|preserved_flags(path), 0)) {
+      fprintf(stderr, "remount %s read-only: %s\n", path, strerror(errno));
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* outer paths sort first, so inner trees are mounted on top of them */
+static bool outer_first(std::string const& a, std::string const& b)
+{
+  return a.length() < b.length();
+}
+
+/* filesystems which can't be, or shouldn't be, used as an overlay lower */
+static bool is_pseudo_fs(std::string const& type)
+{
+  static const char* const types[] = {
+    "autofs", "binfmt_misc", "bpf", "cgroup", "cgroup2", "configfs",
+    "debugfs", "devpts", "devtmpfs", "efivarfs", "fusectl", "hugetlbfs",
+    "mqueue", "nsfs", "proc", "pstore", "rpc_pipefs", "securityfs",
+    "selinuxfs", "sysfs", "tracefs", 0
+  };
+  for (const char* const* t = types; *t; ++t) {
+    if (type == *t) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* bind a single mount (without its submounts) onto target, read-only */
+static int bind_readonly(const char* path, const char* target)
+{
+  if (mount(path, target, 0, MS_BIND, 0)
+      || mount(0, target, 0,
+	       MS_REMOUNT|MS_BIND|MS_RDONLY|preserved_flags(path), 0)) {
+    fprintf(stderr, "bind %s read-only: %s\n", path, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+/* escape characters with special meaning in overlayfs options */
+static std::string overlay_escape(std::string const& path)
+{
+  std::string out;
+  for (char c : path) {
+    if (c == ',' || c == ':' || c == '\\') {
+      out += '\\';
+    }
+    out += c;
+  }
+  return out;
+}
+
+static int path_depth(std::string const& path)
+{
+  return path == "/" ? 0 : std::count(path.begin(), path.end(), '/');
+}
+
+/*
+  Mounts sorted so that each comes after the mounts it's on top of, which
+  /proc/self/mountinfo doesn't guarantee. Mounts on the same path keep
+  their order, which is bottom first.
+*/
+static bool parent_first(MountInfo const& a, MountInfo const& b)
+{
+  return path_depth(a.mountpoint) < path_depth(b.mountpoint);
+}
+
+/*
+  Remove mounts hidden by another mount on the same path, and their
+  submounts; mounts must be sorted parent first.
+*/
+static void remove_hidden(std::vector<MountInfo>* mounts)
+{
+  std::set<int> hidden;
+  for (MountInfo const& info : *mounts) {
+    for (MountInfo const& other : *mounts) {
+      if (other.parent == info.id && other.mountpoint == info.mountpoint) {
+	hidden.insert(info.id);
+      }
+    }
+  }
+
+  std::map<int, std::string> mountpoints;
+  for (MountInfo const& info : *mounts) {
+    mountpoints[info.id] = info.mountpoint;
+  }
+
+  std::vector<MountInfo> visible;
+  for (MountInfo const& info : *mounts) {
+    /* a mount on the same path as its hidden parent is what hides it */
+    if (hidden.count(info.parent)
+	&& mountpoints[info.parent] != info.mountpoint) {
+      hidden.insert(info.id);
+    }
+    if (!hidden.count(info.id)) {
+      visible.push_back(info);
+    }
+  }
+  mounts->swap(visible);
+}
+
+/*
+  Find or assign the index of each mount's upper and work directories in
+  a kept upper directory, using its manifest of "<index>\t<mountpoint>"
+  lines; so a later sandbox using the same directory sees earlier writes.
+*/
+static int read_upper_manifest(std::string const& file,
+			       std::vector<MountInfo> const& mounts,
+			       std::vector<int>* index)
+{
+  std::vector<std::string> known;
+  FILE* in = fopen(file.c_str(), "r");
+  if (in) {
+    char* line = 0;
+    size_t size = 0;
+    ssize_t len;
+    while (-1 != (len = getline(&line, &size, in))) {
+      char* tab = strchr(line, '\t');
+      if (!tab || line[len - 1] != '\n') {
+	continue;
+      }
+      line[len - 1] = 0;
+      size_t i = atoi(line);
+      if (known.size() <= i) {
+	known.resize(i + 1);
+      }
+      known[i] = tab + 1;
+    }
+    free(line);
+    fclose(in);
+  }
+
+  FILE* out = fopen(file.c_str(), "a");
+  if (!out) {
+    fprintf(stderr, "open %s: %s\n", file.c_str(), strerror(errno));
+    return -1;
+  }
+
+  for (MountInfo const& info : mounts) {
+    auto it = std::find(known.begin(), known.end(), info.mountpoint);
+    if (it == known.end()) {
+      it = known.insert(known.end(), info.mountpoint);
+      fprintf(out, "%d\t%s\n", int(it - known.begin()),
+	      info.mountpoint.c_str());
+    }
+    index->push_back(it - known.begin());
+  }
+
+  if (fclose(out)) {
+    fprintf(stderr, "write %s: %s\n", file.c_str(), strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+/*
+  Build the root from one overlay per mount, with the original mount as
+  the lower layer. Overlays don't cross mounts, so each mount needs its
+  own; pseudo filesystems, and any mount which can't be overlaid, are
+  bound read-only instead.
+*/
+static int overlay_root(const Context* ctx, std::string const& root)
+{
+  std::vector<MountInfo> mounts;
+  if (read_mountinfo(&mounts)) {
+    return -1;
+  }
+  std::stable_sort(mounts.begin(), mounts.end(), parent_first);
+  remove_hidden(&mounts);
+
+  std::vector<int> index;
+  std::string store = ctx->fs_upper;
+  if (store.empty()) {
+    /*
+      Upper directories go on a tmpfs private to this sandbox, mounted on
+      the root and then covered by the overlays; it's freed when the
+      sandbox exits.
+    */
+    store = root;
+    if (mount("tmpfs", store.c_str(), "tmpfs", MS_NOSUID|MS_NODEV,
+	      "mode=700")) {
+      perror("mount tmpfs for overlay");
+      return -1;
+    }
+    for (size_t i = 0; i < mounts.size(); ++i) {
+      index.push_back(i);
+    }
+  } else if (read_upper_manifest(store + "/mounts", mounts, &index)) {
+    return -1;
+  }
+
+  /* refer to the store by fd, since it may be covered by the overlays */
+  int store_fd = open(store.c_str(), O_PATH|O_DIRECTORY|O_CLOEXEC);
+  if (store_fd == -1) {
+    fprintf(stderr, "open %s: %s\n", store.c_str(), strerror(errno));
+    return -1;
+  }
+  char store_path[64];
+  snprintf(store_path, sizeof(store_path), "/proc/self/fd/%d", store_fd);
+
+  int result = 0;
+  for (size_t i = 0; i < mounts.size() && !result; ++i) {
+    MountInfo const& info = mounts[i];
+    std::string target = root + info.mountpoint;
+    const char* path = info.mountpoint.c_str();
+
+    if (is_pseudo_fs(info.fstype)) {
+      debug("fs: binding %s (%s) read-only\n", path, info.fstype.c_str());
+      result = bind_readonly(path, target.c_str());
+      continue;
+    }
+
+    char dir[32];
+    snprintf(dir, sizeof(dir), "%d", index[i]);
+    std::string upper = std::string(dir) + "/upper";
+    std::string work = std::string(dir) + "/work";
+    mkdirat(store_fd, dir, 0700);
+    mkdirat(store_fd, upper.c_str(), 0755);
+    mkdirat(store_fd, work.c_str(), 0700);
+
+    std::string options = "lowerdir=" + overlay_escape(info.mountpoint)
+      + ",upperdir=" + store_path + "/" + upper
+      + ",workdir=" + store_path + "/" + work;
+    debug("fs: overlay on %s: %s\n", path, options.c_str());
+    if (mount("overlay", target.c_str(), "overlay", 0, options.c_str())) {
+      debug("fs: overlay on %s: %s; binding read-only\n", path,
+	    strerror(errno));
+      result = bind_readonly(path, target.c_str());
+    }
+  }
+
+  close(store_fd);
+  return result;
+}
+
+int bind_readonly_tree(const char* source, std::string const& target)
+{
+  if (mount(source, target.c_str(), 0, MS_BIND|MS_REC, 0)) {
+    fprintf(stderr, "bind %s on %s: %s\n", source, target.c_str(),
+	    strerror(errno));
+    return -1;
+  }
+
+  if (set_readonly_recursive(target.c_str())) {
+    debug("fs: mount_setattr: %s; remounting each mount\n", strerror(errno));
+    return set_readonly_each(target);
+  }
+  return 0;
+}
+
+int unmount_stack(std::string const& path)
+{
+  /* EINVAL once nothing is left mounted there */
+  while (0 == umount2(path.c_str(), MNT_DETACH)) {
+    debug("fs: detached a mount from %s\n", path.c_str());
+  }
+  if (errno != EINVAL) {
+    fprintf(stderr, "umount %s: %s\n", path.c_str(), strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+int start_kernel_sandbox(const Context* ctx)
+{
+  std::string const& root = ctx->fuse_mountpoint;
+
+  /* keep our mounts out of the parent namespace, and theirs out of ours */
+  if (mount(0, "/", 0, MS_REC|MS_PRIVATE, 0)) {
+    perror("make / private");
+    return -1;
+  }
+
+  if (ctx->fs_mode == FS_MODE_OVERLAY
+      ? overlay_root(ctx, root)
+      : bind_readonly_tree("/", root)) {
+    return -1;
+  }
+
+  std::vector<std::string> writable(ctx->fuse_writable_paths.begin(),
+				    ctx->fuse_writable_paths.end());
+  std::stable_sort(writable.begin(), writable.end(), outer_first);
+
+  for (std::string const& path : writable) {
+    std::string target = root + path;
+    debug("fs: path %s is writable\n", path.c_str());
+    if (mount(path.c_str(), target.c_str(), 0, MS_BIND|MS_REC, 0)) {
+      fprintf(stderr, "bind %s: %s\n", path.c_str(), strerror(errno));
+      return -1;
+    }
+
+    /*
+      If the sandbox root is itself under the writable tree, the bind
+      brought along a copy of the sandbox, including the overlay's upper
+      store mounted beneath it; remove all of it.
+    */
+    if (path_is_under(root, path) && unmount_stack(root + root)) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,52 @@
+#ifndef SANDBOX_KERNEL_SANDBOX_H
+#define SANDBOX_KERNEL_SANDBOX_H
+
+
+/*
+  Copyright (c) 2012 Rohan McGovern <rohan@mcgovern.id.au>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+  LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <string>
+
+struct Context;
+
+/*
+  Build the sandbox root at ctx->fuse_mountpoint from bind mounts or
+  overlays (--fs-mode=bind or overlay). Must be called in the sandbox's
+  own mount namespace; returns 0, or -1 with an error printed.
+*/
+int start_kernel_sandbox(const Context* ctx);
+
+/*
+  Bind source and all mounts below it onto target, read-only; returns 0,
+  or -1 with an error printed.
+*/
+int bind_readonly_tree(const char* source, std::string const& target);
+
+/*
+  Detach every mount stacked on path, such as a copy of the sandbox root
+  brought along by a recursive bind of a tree containing it; returns 0,
+  or -1 with an error printed.
+*/
+int unmount_stack(std::string const& path);
+
+#endif
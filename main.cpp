@@ -22,6 +22,7 @@
 */
 
 #include <string>
+#include <vector>
 
 #include <errno.h>
 #include <getopt.h>
@@ -30,14 +31,59 @@
 #include <string.h>
 #include <unistd.h>
 #include <limits.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <stdlib.h>
 
 
 #include "shared.h"
+#include "batch.h"
+#include "fs_daemon.h"
 #include "run.h"
+#include "report.h"
+#include "server.h"
+#include "trace.h"
 
 #define OPTION_NOT  (1<<16)
 #define OPTION_FS_ALLOW 0x101
+#define OPTION_FS_CACHE 0x102
+#define OPTION_FS_ENGINE 0x103
+#define OPTION_FS_THREADS 0x104
+#define OPTION_FS_MAX_IDLE_THREADS 0x105
+#define OPTION_FS_MAX_BACKGROUND 0x106
+#define OPTION_FS_STATS 0x107
+#define OPTION_FS_MODE 0x108
+#define OPTION_FS_UPPER 0x109
+#define OPTION_SERVER 0x10a
+#define OPTION_POOL_SIZE 0x10b
+#define OPTION_CONNECT 0x10c
+#define OPTION_BATCH 0x10d
+#define OPTION_JOBS 0x10e
+#define OPTION_BATCH_REPORT 0x10f
+#define OPTION_TRACE_STARTUP 0x110
+#define OPTION_TMPFS 0x111
+#define OPTION_BIND 0x112
+#define OPTION_RO_BIND 0x113
+#define OPTION_PROC 0x114
+#define OPTION_MEMORY_MAX 0x115
+#define OPTION_CPU_MAX 0x116
+#define OPTION_IO_MAX 0x117
+#define OPTION_PIDS_MAX 0x118
+#define OPTION_CGROUP_PARENT 0x119
+#define OPTION_CGROUP_FUSE 0x11a
+#define OPTION_REPORT 0x11b
+#define OPTION_FS_ATTR_CACHE_TTL 0x11c
+#define OPTION_FS_URING 0x11d
+#define OPTION_FS_OPT 0x11e
+#define OPTION_FS_DAEMON 0x11f
+#define OPTION_FS_CONNECT 0x120
+#define OPTION_FS_CONTENT_CACHE 0x121
+#define OPTION_FS_CONTENT_CACHE_FILE_MAX 0x122
+#define OPTION_FS_AUDIT 0x123
+#define OPTION_FS_AUDIT_ALLOWED 0x124
+#define OPTION_FS_TRACE_READS 0x125
+#define OPTION_FS_TRACE_HASHES 0x126
 static const char optionstring[] = "+hd";
 
 #define OPTION_BOOL(longopt, value) \
@@ -49,6 +95,43 @@ static const struct option options[] = {
   { "debug", 0, 0, 'd' },
   { "none", 0, 0, 'N' },
   { "fs-allow", 1, 0, OPTION_FS_ALLOW },
+  { "fs-mode", 1, 0, OPTION_FS_MODE },
+  { "fs-upper", 1, 0, OPTION_FS_UPPER },
+  { "fs-cache", 1, 0, OPTION_FS_CACHE },
+  { "tmpfs", 1, 0, OPTION_TMPFS },
+  { "bind", 1, 0, OPTION_BIND },
+  { "ro-bind", 1, 0, OPTION_RO_BIND },
+  { "proc", 1, 0, OPTION_PROC },
+  { "fs-engine", 1, 0, OPTION_FS_ENGINE },
+  { "fs-threads", 1, 0, OPTION_FS_THREADS },
+  { "fs-max-idle-threads", 1, 0, OPTION_FS_MAX_IDLE_THREADS },
+  { "fs-max-background", 1, 0, OPTION_FS_MAX_BACKGROUND },
+  { "fs-stats", 2, 0, OPTION_FS_STATS },
+  { "fs-audit", 1, 0, OPTION_FS_AUDIT },
+  OPTION_BOOL("fs-audit-allowed", OPTION_FS_AUDIT_ALLOWED),
+  { "fs-trace-reads", 1, 0, OPTION_FS_TRACE_READS },
+  OPTION_BOOL("fs-trace-hashes", OPTION_FS_TRACE_HASHES),
+  { "fs-attr-cache-ttl", 1, 0, OPTION_FS_ATTR_CACHE_TTL },
+  OPTION_BOOL("fs-uring", OPTION_FS_URING),
+  { "fs-opt", 1, 0, OPTION_FS_OPT },
+  { "fs-content-cache", 1, 0, OPTION_FS_CONTENT_CACHE },
+  { "fs-content-cache-file-max", 1, 0, OPTION_FS_CONTENT_CACHE_FILE_MAX },
+  { "memory-max", 1, 0, OPTION_MEMORY_MAX },
+  { "cpu-max", 1, 0, OPTION_CPU_MAX },
+  { "io-max", 1, 0, OPTION_IO_MAX },
+  { "pids-max", 1, 0, OPTION_PIDS_MAX },
+  { "cgroup-parent", 1, 0, OPTION_CGROUP_PARENT },
+  OPTION_BOOL("cgroup-fuse", OPTION_CGROUP_FUSE),
+  { "server", 1, 0, OPTION_SERVER },
+  { "pool-size", 1, 0, OPTION_POOL_SIZE },
+  { "connect", 1, 0, OPTION_CONNECT },
+  { "fs-daemon", 1, 0, OPTION_FS_DAEMON },
+  { "fs-connect", 1, 0, OPTION_FS_CONNECT },
+  { "batch", 1, 0, OPTION_BATCH },
+  { "jobs", 1, 0, OPTION_JOBS },
+  { "batch-report", 1, 0, OPTION_BATCH_REPORT },
+  { "trace-startup", 2, 0, OPTION_TRACE_STARTUP },
+  { "report", 1, 0, OPTION_REPORT },
   OPTION_BOOL("net", 'n'),
   OPTION_BOOL("pid", 'p'),
   OPTION_BOOL("ipc", 'i'),
@@ -60,11 +143,20 @@ static const struct option options[] = {
 void usage(FILE* stream, int exitcode)
 {
   fprintf(stream,
-"Usage: rsandbox [options] [--] command [args]\n\n"
+"Usage: rsandbox [options] [--] command [args]\n"
+"       rsandbox [options] --batch FILE\n"
+"       rsandbox [options] --server SOCKET\n"
+"       rsandbox --connect SOCKET [--] command [args]\n"
+"       rsandbox [options] --fs-daemon SOCKET\n\n"
 "Run a command in a sandbox.\n\n"
 "Options:\n"
 "  --help, -h        Show this message\n"
 "  --debug, -d       Enable debugging messages\n"
+"  --trace-startup[=<file>]\n"
+"                    Time each phase of sandbox setup; print a timeline to\n"
+"                    stderr, or write a Chrome trace to <file>, at exit\n"
+"  --report <file>   Write the resources used by the sandbox to <file> as\n"
+"                    JSON at exit\n"
 "\n"
 "Sandbox features:\n"
 "  All of the following sandbox features are enabled by default.\n"
@@ -100,6 +192,166 @@ void usage(FILE* stream, int exitcode)
 "        Allow writes to the specified path(s).\n"
 "        <PATH> may contain a single relative or absolute path, or\n"
 "        several paths separated with the : character.\n"
+"\n"
+"  --tmpfs <PATH>[:<OPTIONS>]\n"
+"        Mount an empty, writable tmpfs at <PATH> in the sandbox, with\n"
+"        the given mount options (e.g. size=2G). Files written there\n"
+"        stay in memory and are lost when the sandbox exits.\n"
+"\n"
+"  --bind <SOURCE>[:<PATH>], --ro-bind <SOURCE>[:<PATH>]\n"
+"        Bind mount <SOURCE> at <PATH> in the sandbox (default: at the\n"
+"        same path), writable or read-only.\n"
+"\n"
+"  --proc <PATH>\n"
+"        Mount a proc filesystem for the sandbox at <PATH>.\n"
+"\n"
+"  --fs-mode=<fuse|bind|overlay>\n"
+"        Implementation of the filesystem sandbox (default: fuse).\n"
+"        fuse: files are accessed through a FUSE filesystem.\n"
+"        bind: the filesystem is bind mounted read-only, with writable\n"
+"        paths bound back in; no FUSE process is used, so file access\n"
+"        runs at native speed. The options below which configure the\n"
+"        FUSE filesystem have no effect in this mode. Unlike with fuse,\n"
+"        the writable directories themselves may be modified too.\n"
+"        overlay: as bind, but writes outside of the writable paths are\n"
+"        captured in a temporary directory rather than failing.\n"
+"\n"
+"  --fs-upper <DIR>\n"
+"        With --fs-mode=overlay, keep writes outside of the writable paths\n"
+"        in <DIR> rather than discarding them when the sandbox exits.\n"
+"        Later sandboxes using the same <DIR> see the earlier writes.\n"
+"\n"
+"  --fs-cache=<auto|none|aggressive>\n"
+"        Kernel caching of the sandbox filesystem (default: auto).\n"
+"        auto: cache file data and attributes; cached data is dropped when\n"
+"        a file is found to be modified on open.\n"
+"        none: no caching; every operation goes to the FUSE process.\n"
+"        Shared writable mmap is not supported in this mode.\n"
+"        aggressive: cache for longer and never drop cached data on open;\n"
+"        use only when files won't be modified from outside the sandbox.\n"
+"\n"
+"  --fs-engine=<path|inode>\n"
+"        Implementation of the sandbox filesystem (default: path).\n"
+"        inode: keep a handle to each file in use rather than resolving\n"
+"        full paths for each operation; faster for deep directory trees.\n"
+"\n"
+"  --fs-threads=<n>\n"
+"        Maximum number of threads serving the sandbox filesystem\n"
+"        (default: libfuse's default). Requires libfuse 3.12 or later.\n"
+"\n"
+"  --fs-max-idle-threads=<n>\n"
+"        Number of idle filesystem threads kept around rather than exiting\n"
+"        (default: libfuse's default).\n"
+"\n"
+"  --fs-max-background=<n>\n"
+"        Maximum number of background requests (e.g. readahead) the kernel\n"
+"        queues to the sandbox filesystem (default: kernel's default).\n"
+"\n"
+"  --fs-attr-cache-ttl=<seconds>\n"
+"        How long the FUSE process caches file attributes and missing\n"
+"        files (default: 0 with --fs-cache=none, 60 with aggressive, else\n"
+"        1). Changes made through the sandbox are seen at once. Applies\n"
+"        to the path engine; 0 disables the cache.\n"
+"\n"
+"  --[no-]fs-uring\n"
+"        Batch the per-entry stat calls of directory listings through\n"
+"        io_uring (default: off). Applies to the path engine; ignored with\n"
+"        a warning if the kernel doesn't support io_uring.\n"
+"\n"
+"  --fs-opt <option>[,<option>...]\n"
+"        Tune the FUSE connection; may be repeated. Options:\n"
+"        writeback_cache: let the kernel cache and coalesce writes.\n"
+"        max_write=<size>, max_read=<size>: largest request, in bytes\n"
+"        (K and M suffixes are accepted).\n"
+"        max_readahead=<size>: readahead limit; may only be lowered.\n"
+"\n"
+"  --fs-content-cache=<size>\n"
+"        Keep up to <size> bytes (K, M and G suffixes are accepted) of the\n"
+"        contents of small files opened read-only outside of the writable\n"
+"        paths in the FUSE process (default: 0, no cache). Applies to the\n"
+"        path engine.\n"
+"\n"
+"  --fs-content-cache-file-max=<size>\n"
+"        Largest file kept in the content cache (default: 256K).\n"
+"\n"
+"  --fs-stats[=<file>]\n"
+"        Collect counts, bytes and latencies of filesystem operations.\n"
+"        A summary is printed to stderr, or written to <file> as JSON,\n"
+"        when the sandbox exits and when the FUSE process gets SIGUSR1.\n"
+"\n"
+"  --fs-audit <file>\n"
+"        Append a JSON line to <file> for each write denied by the sandbox,\n"
+"        with the time, operation, path, process ID and error.\n"
+"\n"
+"  --fs-audit-allowed, --no-fs-audit-allowed\n"
+"        Whether --fs-audit also records writes which are allowed (default:\n"
+"        no).\n"
+"\n"
+"  --fs-trace-reads <file>\n"
+"        When the sandbox exits, write each path looked up, read or listed\n"
+"        by the command to <file>, once, as a JSON line. Requires the path\n"
+"        engine and a FUSE process of the sandbox's own.\n"
+"\n"
+"  --fs-trace-hashes, --no-fs-trace-hashes\n"
+"        Whether --fs-trace-reads includes the SHA-256 of each file, symbolic\n"
+"        link and listed directory, as of the exit (default: no).\n"
+"\n"
+"Resource limits:\n"
+"\n"
+"  --memory-max <BYTES>\n"
+"        Limit the memory used by the sandbox (e.g. 4G).\n"
+"\n"
+"  --cpu-max <CPUS>\n"
+"        Limit the sandbox to <CPUS> CPUs' worth of time (e.g. 2 or 0.5).\n"
+"\n"
+"  --io-max '<DEVICE> <LIMITS>'\n"
+"        Limit I/O to the block device <DEVICE> (a path, or MAJOR:MINOR)\n"
+"        with cgroup io.max keys, e.g. '/dev/sda wbps=10485760'.\n"
+"\n"
+"  --pids-max <N>\n"
+"        Limit the number of processes and threads in the sandbox.\n"
+"\n"
+"  --cgroup-parent <CGROUP>\n"
+"        Create the sandbox's cgroup below <CGROUP> (default: the cgroup\n"
+"        of rsandbox).\n"
+"\n"
+"  --cgroup-fuse, --no-cgroup-fuse\n"
+"        Whether the FUSE process counts against the limits (default:\n"
+"        yes).\n"
+"\n"
+"Server options:\n"
+"\n"
+"  --server <SOCKET>\n"
+"        Keep a pool of prepared sandboxes, running commands received on\n"
+"        the Unix socket <SOCKET> from `rsandbox --connect'.\n"
+"\n"
+"  --pool-size <N>\n"
+"        Number of sandboxes kept ready by the server (default: 4).\n"
+"\n"
+"  --connect <SOCKET>\n"
+"        Run the command in a sandbox from the server on <SOCKET>.\n"
+"\n"
+"  --fs-daemon <SOCKET>\n"
+"        Serve the filesystems of many sandboxes from this one process,\n"
+"        for sandboxes started with `rsandbox --fs-connect <SOCKET>'.\n"
+"\n"
+"  --fs-connect <SOCKET>\n"
+"        Have the sandbox filesystem served by the daemon on <SOCKET>,\n"
+"        rather than by a FUSE process of its own. Requires the path engine\n"
+"        and the pid sandbox.\n"
+"\n"
+"Batch options:\n"
+"\n"
+"  --batch <FILE>\n"
+"        Run each line of <FILE> (- for stdin) as a shell command, all in\n"
+"        the same sandbox. Exits with status 1 if any command fails.\n"
+"\n"
+"  --jobs <N>\n"
+"        Number of batch commands run at once (default: number of CPUs).\n"
+"\n"
+"  --batch-report <FILE>\n"
+"        Write the exit status and timing of each batch command to <FILE>\n"
+"        as JSON.\n"
 	  );
   exit(exitcode);
 }
@@ -117,25 +369,228 @@ std::string realpath(std::string const& path)
   return out;
 }
 
-void parse_fs_allow(Context* ctx, const char* arg)
+/* split a :-separated list, in which \\ escapes the next character */
+std::vector<std::string> split_list(const char* arg)
 {
+  std::vector<std::string> out(1);
   int backslash = 0;
-  std::string current_arg;
   while (*arg) {
     if (backslash) {
-      current_arg.append(1, *arg);
+      out.back().append(1, *arg);
       backslash = 0;
     } else if (*arg == '\\') {
       backslash = 1;
     } else if (*arg == ':') {
-      ctx->fuse_writable_paths.push_back(realpath(current_arg));
-      current_arg.clear();
+      out.push_back(std::string());
     } else {
-      current_arg.append(1, *arg);
+      out.back().append(1, *arg);
     }
     ++arg;
   }
-  ctx->fuse_writable_paths.push_back(realpath(current_arg));
+  return out;
+}
+
+void parse_fs_allow(Context* ctx, const char* arg)
+{
+  for (std::string const& path : split_list(arg)) {
+    ctx->fuse_writable_paths.push_back(realpath(path));
+  }
+}
+
+/* --cpu-max CPUS: the cgroup cpu.max quota and period */
+void parse_cpu_max(Context* ctx, const char* arg)
+{
+  const int period = 100000;
+  char* end;
+  double cpus = strtod(arg, &end);
+  if (0 == strcmp(arg, "max")) {
+    ctx->cpu_max = "max";
+  } else if (end == arg || *end || !(cpus > 0) || cpus * period > INT_MAX) {
+    fprintf(stderr, "Invalid value for --cpu-max: %s\n", arg);
+    usage(stderr, 3);
+  } else {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%d %d", (int)(cpus * period), period);
+    ctx->cpu_max = buf;
+  }
+}
+
+/* --io-max 'DEVICE LIMITS': a line of the cgroup io.max file */
+void parse_io_max(Context* ctx, const char* arg)
+{
+  const char* space = strchr(arg, ' ');
+  if (!space || space == arg) {
+    fprintf(stderr, "Invalid value for --io-max: %s\n", arg);
+    usage(stderr, 3);
+  }
+
+  std::string device(arg, space);
+  if (device[0] == '/') {
+    struct stat st;
+    if (stat(device.c_str(), &st) || !S_ISBLK(st.st_mode)) {
+      fprintf(stderr, "Invalid value for --io-max: %s is not a block "
+	      "device\n", device.c_str());
+      exit(3);
+    }
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%u:%u", major(st.st_rdev),
+	     minor(st.st_rdev));
+    device = buf;
+  }
+  ctx->io_max.push_back(device + space);
+}
+
+/* --tmpfs PATH[:OPTIONS], --[ro-]bind SOURCE[:PATH], --proc PATH */
+void parse_mount(Context* ctx, int type, const char* option, const char* arg)
+{
+  std::vector<std::string> fields = split_list(arg);
+  MountSpec spec;
+  spec.type = type;
+  size_t max_fields = type == MOUNT_PROC ? 1 : 2;
+  if (type == MOUNT_BIND || type == MOUNT_RO_BIND) {
+    spec.source = realpath(fields[0]);
+    spec.target = fields.size() > 1 ? fields[1] : spec.source;
+  } else {
+    spec.target = fields[0];
+    if (fields.size() > 1) {
+      spec.options = fields[1];
+    }
+  }
+  if (fields.size() > max_fields || spec.target[0] != '/') {
+    fprintf(stderr, "Invalid value for --%s: %s\n"
+	    "The path in the sandbox must be absolute.\n", option, arg);
+    usage(stderr, 3);
+  }
+  ctx->mounts.push_back(spec);
+}
+
+void parse_fs_cache(Context* ctx, const char* arg)
+{
+  if (0 == strcmp(arg, "auto")) {
+    ctx->fs_cache = FS_CACHE_AUTO;
+  } else if (0 == strcmp(arg, "none")) {
+    ctx->fs_cache = FS_CACHE_NONE;
+  } else if (0 == strcmp(arg, "aggressive")) {
+    ctx->fs_cache = FS_CACHE_AGGRESSIVE;
+  } else {
+    fprintf(stderr, "Invalid value for --fs-cache: %s\n", arg);
+    usage(stderr, 3);
+  }
+}
+
+void parse_fs_mode(Context* ctx, const char* arg)
+{
+  if (0 == strcmp(arg, "fuse")) {
+    ctx->fs_mode = FS_MODE_FUSE;
+  } else if (0 == strcmp(arg, "bind")) {
+    ctx->fs_mode = FS_MODE_BIND;
+  } else if (0 == strcmp(arg, "overlay")) {
+    ctx->fs_mode = FS_MODE_OVERLAY;
+  } else {
+    fprintf(stderr, "Invalid value for --fs-mode: %s\n", arg);
+    usage(stderr, 3);
+  }
+}
+
+void parse_fs_engine(Context* ctx, const char* arg)
+{
+  if (0 == strcmp(arg, "path")) {
+    ctx->fs_engine = FS_ENGINE_PATH;
+  } else if (0 == strcmp(arg, "inode")) {
+    ctx->fs_engine = FS_ENGINE_INODE;
+  } else {
+    fprintf(stderr, "Invalid value for --fs-engine: %s\n", arg);
+    usage(stderr, 3);
+  }
+}
+
+/* a size in bytes, with an optional K, M or G suffix; -1 if invalid */
+long long parse_size(const char* arg)
+{
+  char* end;
+  errno = 0;
+  long long size = strtoll(arg, &end, 10);
+  int shift = 0;
+  if (*end == 'k' || *end == 'K') {
+    shift = 10;
+  } else if (*end == 'm' || *end == 'M') {
+    shift = 20;
+  } else if (*end == 'g' || *end == 'G') {
+    shift = 30;
+  }
+  if (shift) {
+    ++end;
+  }
+  if (errno || end == arg || *end || size < 0 || size > (LLONG_MAX >> shift)) {
+    return -1;
+  }
+  return size << shift;
+}
+
+/* a size for the given option */
+size_t parse_option_size(const char* option, const char* arg)
+{
+  long long size = parse_size(arg);
+  if (size < 0) {
+    fprintf(stderr, "Invalid value for --%s: %s\n", option, arg);
+    usage(stderr, 3);
+  }
+  return size;
+}
+
+/* a size for --fs-opt */
+unsigned parse_fs_opt_size(std::string const& opt, const char* value)
+{
+  long long size = parse_size(value);
+  if (size <= 0 || size > (1LL << 30)) {
+    fprintf(stderr, "Invalid value for --fs-opt: %s\n", opt.c_str());
+    usage(stderr, 3);
+  }
+  return size;
+}
+
+/* --fs-opt OPTION[,OPTION...]: tuning of the FUSE connection */
+void parse_fs_opt(Context* ctx, const char* arg)
+{
+  const char* start = arg;
+  for (;;) {
+    const char* comma = strchr(start, ',');
+    std::string opt = comma ? std::string(start, comma) : std::string(start);
+    size_t equals = opt.find('=');
+    std::string name = opt.substr(0, equals);
+    const char* value = equals == std::string::npos
+      ? 0 : opt.c_str() + equals + 1;
+
+    if (name == "writeback_cache" && !value) {
+      ctx->fs_writeback_cache = 1;
+    } else if (name == "max_write" && value) {
+      ctx->fs_max_write = parse_fs_opt_size(opt, value);
+    } else if (name == "max_read" && value) {
+      ctx->fs_max_read = parse_fs_opt_size(opt, value);
+    } else if (name == "max_readahead" && value) {
+      ctx->fs_max_readahead = parse_fs_opt_size(opt, value);
+    } else {
+      fprintf(stderr, "Invalid value for --fs-opt: %s\n", opt.c_str());
+      usage(stderr, 3);
+    }
+
+    if (!comma) {
+      break;
+    }
+    start = comma + 1;
+  }
+}
+
+int parse_count(const char* option, const char* arg)
+{
+  char* end;
+  errno = 0;
+  long value = strtol(arg, &end, 10);
+  if (errno || end == arg || *end || value < 0 || value > 65535) {
+    fprintf(stderr, "Invalid value for --%s: %s\n", option, arg);
+    usage(stderr, 3);
+  }
+  return value;
 }
 
 void parse_arguments(Context* ctx, int argc, char** argv)
@@ -196,16 +651,226 @@ void parse_arguments(Context* ctx, int argc, char** argv)
     case OPTION_FS_ALLOW:
       parse_fs_allow(ctx, optarg);
       break;
+
+    case OPTION_FS_MODE:
+      parse_fs_mode(ctx, optarg);
+      break;
+
+    case OPTION_MEMORY_MAX:
+      ctx->cgroup = 1;
+      ctx->memory_max = optarg;
+      break;
+
+    case OPTION_CPU_MAX:
+      ctx->cgroup = 1;
+      parse_cpu_max(ctx, optarg);
+      break;
+
+    case OPTION_IO_MAX:
+      ctx->cgroup = 1;
+      parse_io_max(ctx, optarg);
+      break;
+
+    case OPTION_PIDS_MAX:
+      ctx->cgroup = 1;
+      ctx->pids_max = optarg;
+      break;
+
+    case OPTION_CGROUP_PARENT:
+      ctx->cgroup = 1;
+      ctx->cgroup_parent = optarg;
+      break;
+
+    case OPTION_CGROUP_FUSE:
+      ctx->cgroup_fuse = enable;
+      break;
+
+    case OPTION_SERVER:
+      ctx->server_socket = optarg;
+      break;
+
+    case OPTION_POOL_SIZE:
+      ctx->pool_size = parse_count("pool-size", optarg);
+      if (!ctx->pool_size) {
+	fprintf(stderr, "Invalid value for --pool-size: %s\n", optarg);
+	usage(stderr, 3);
+      }
+      break;
+
+    case OPTION_CONNECT:
+      ctx->connect_socket = optarg;
+      break;
+
+    case OPTION_FS_DAEMON:
+      ctx->fs_daemon_socket = optarg;
+      break;
+
+    case OPTION_FS_CONNECT:
+      ctx->fs_connect_socket = optarg;
+      break;
+
+    case OPTION_BATCH:
+      ctx->batch = 1;
+      read_batch(ctx, optarg);
+      break;
+
+    case OPTION_JOBS:
+      ctx->batch_jobs = parse_count("jobs", optarg);
+      if (!ctx->batch_jobs) {
+	fprintf(stderr, "Invalid value for --jobs: %s\n", optarg);
+	usage(stderr, 3);
+      }
+      break;
+
+    case OPTION_BATCH_REPORT:
+      ctx->batch_report_fd = open(optarg, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC,
+				  0666);
+      if (ctx->batch_report_fd == -1) {
+	fprintf(stderr, "Could not open %s: %s\n", optarg, strerror(errno));
+	exit(4);
+      }
+      break;
+
+    case OPTION_REPORT:
+      ctx->report_file = optarg;
+      break;
+
+    case OPTION_TRACE_STARTUP:
+      ctx->trace_startup = 1;
+      ctx->trace_file = optarg ? optarg : "";
+      break;
+
+    case OPTION_FS_UPPER:
+      ctx->fs_upper = optarg;
+      break;
+
+    case OPTION_TMPFS:
+      parse_mount(ctx, MOUNT_TMPFS, "tmpfs", optarg);
+      break;
+
+    case OPTION_BIND:
+      parse_mount(ctx, MOUNT_BIND, "bind", optarg);
+      break;
+
+    case OPTION_RO_BIND:
+      parse_mount(ctx, MOUNT_RO_BIND, "ro-bind", optarg);
+      break;
+
+    case OPTION_PROC:
+      parse_mount(ctx, MOUNT_PROC, "proc", optarg);
+      break;
+
+    case OPTION_FS_CACHE:
+      parse_fs_cache(ctx, optarg);
+      break;
+
+    case OPTION_FS_ENGINE:
+      parse_fs_engine(ctx, optarg);
+      break;
+
+    case OPTION_FS_THREADS:
+      ctx->fs_threads = parse_count("fs-threads", optarg);
+      break;
+
+    case OPTION_FS_MAX_IDLE_THREADS:
+      ctx->fs_max_idle_threads = parse_count("fs-max-idle-threads", optarg);
+      break;
+
+    case OPTION_FS_MAX_BACKGROUND:
+      ctx->fs_max_background = parse_count("fs-max-background", optarg);
+      break;
+
+    case OPTION_FS_ATTR_CACHE_TTL: {
+      char* end;
+      ctx->fs_attr_cache_ttl = strtod(optarg, &end);
+      if (end == optarg || *end || !(ctx->fs_attr_cache_ttl >= 0)) {
+	fprintf(stderr, "Invalid value for --fs-attr-cache-ttl: %s\n", optarg);
+	usage(stderr, 3);
+      }
+      break;
+    }
+
+    case OPTION_FS_URING:
+      ctx->fs_uring = enable;
+      break;
+
+    case OPTION_FS_OPT:
+      parse_fs_opt(ctx, optarg);
+      break;
+
+    case OPTION_FS_CONTENT_CACHE:
+      ctx->fs_content_cache = parse_option_size("fs-content-cache", optarg);
+      break;
+
+    case OPTION_FS_CONTENT_CACHE_FILE_MAX:
+      ctx->fs_content_cache_file_max =
+	parse_option_size("fs-content-cache-file-max", optarg);
+      break;
+
+    case OPTION_FS_STATS:
+      ctx->fs_stats = 1;
+      ctx->fs_stats_file = optarg ? optarg : "";
+      break;
+
+    case OPTION_FS_AUDIT:
+      ctx->fs_audit_file = optarg;
+      break;
+
+    case OPTION_FS_AUDIT_ALLOWED:
+      ctx->fs_audit_allowed = enable;
+      break;
+
+    case OPTION_FS_TRACE_READS:
+      ctx->fs_trace_reads_file = optarg;
+      break;
+
+    case OPTION_FS_TRACE_HASHES:
+      ctx->fs_trace_hashes = enable;
+      break;
     }
   }
 
   debug("optind %d\n", optind);
 
   ctx->child_argv = &argv[optind];
-  if (!ctx->child_argv[0]) {
+  if (ctx->batch) {
+    if (ctx->child_argv[0] || !ctx->server_socket.empty()
+	|| !ctx->connect_socket.empty()) {
+      fprintf(stderr, "error: --batch can't be used with a command, "
+	      "--server or --connect.\n");
+      exit(3);
+    }
+  } else if (!ctx->fs_daemon_socket.empty()) {
+    if (ctx->child_argv[0] || ctx->fs_engine != FS_ENGINE_PATH) {
+      fprintf(stderr, "error: --fs-daemon can't be used with a command or "
+	      "--fs-engine=inode.\n");
+      exit(3);
+    }
+  } else if (!ctx->child_argv[0] && ctx->server_socket.empty()) {
     fprintf(stderr, "Not enough arguments\n");
     usage(stderr, 3);
   }
+  if (!ctx->fs_connect_socket.empty()
+      && (!ctx->fs || ctx->fs_mode != FS_MODE_FUSE
+	  || ctx->fs_engine != FS_ENGINE_PATH || !ctx->pidns)) {
+    /* the pid sandbox gives the mount a namespace which dies with it */
+    fprintf(stderr, "error: --fs-connect requires --fs-mode=fuse, "
+	    "--fs-engine=path and --pid.\n");
+    exit(3);
+  }
+  if (!ctx->fs_trace_reads_file.empty()
+      && (!ctx->fs || ctx->fs_mode != FS_MODE_FUSE
+	  || ctx->fs_engine != FS_ENGINE_PATH
+	  || !ctx->fs_connect_socket.empty()
+	  || !ctx->fs_daemon_socket.empty())) {
+    fprintf(stderr, "error: --fs-trace-reads requires --fs-mode=fuse and "
+	    "--fs-engine=path, without --fs-connect or --fs-daemon.\n");
+    exit(3);
+  }
+  if (ctx->batch_report_fd != -1 && !ctx->batch) {
+    fprintf(stderr, "error: --batch-report requires --batch.\n");
+    exit(3);
+  }
 
   if (ctx->fs && !ctx->mountns) {
     fprintf(stderr, "error: filesystem sandbox requires mount sandbox.\n"
@@ -213,6 +878,26 @@ void parse_arguments(Context* ctx, int argc, char** argv)
     exit(3);
   }
 
+  if (!ctx->mounts.empty() && !ctx->mountns) {
+    fprintf(stderr, "error: --tmpfs, --bind, --ro-bind and --proc require "
+	    "mount sandbox.\n"
+	    "Try adding --mount to the rsandbox arguments.\n");
+    exit(3);
+  }
+
+  if (!ctx->fs_upper.empty()) {
+    if (ctx->fs_mode != FS_MODE_OVERLAY) {
+      fprintf(stderr, "error: --fs-upper requires --fs-mode=overlay.\n");
+      exit(3);
+    }
+    if (mkdir(ctx->fs_upper.c_str(), 0700) && errno != EEXIST) {
+      fprintf(stderr, "Could not create %s: %s\n", ctx->fs_upper.c_str(),
+	      strerror(errno));
+      exit(4);
+    }
+    ctx->fs_upper = realpath(ctx->fs_upper);
+  }
+
   ctx->mount_proc = ctx->mountns && ctx->pidns;
 
   /*
@@ -221,7 +906,8 @@ void parse_arguments(Context* ctx, int argc, char** argv)
     be visible within the sandbox, and killing the top-level sandbox
     process is guaranteed to kill the fuse process.
   */
-  ctx->clone_for_fuse = ctx->fs && ctx->pidns;
+  ctx->clone_for_fuse = ctx->fs && ctx->pidns
+    && ctx->fs_mode == FS_MODE_FUSE;
 }
 
 static char* mountpoint = 0;
@@ -263,10 +949,61 @@ int main(int argc, char** argv)
   ctx.mountns = 1;
   ctx.ipcns = 1;
   ctx.fs = 1;
+  ctx.fs_mode = FS_MODE_FUSE;
+  ctx.fs_cache = FS_CACHE_AUTO;
+  ctx.fs_engine = FS_ENGINE_PATH;
+  ctx.fs_threads = 0;
+  ctx.fs_max_idle_threads = -1;
+  ctx.fs_max_background = 0;
+  ctx.fs_attr_cache_ttl = -1;
+  ctx.fs_uring = 0;
+  ctx.fs_writeback_cache = 0;
+  ctx.fs_max_write = 0;
+  ctx.fs_max_read = 0;
+  ctx.fs_max_readahead = 0;
+  ctx.fs_content_cache = 0;
+  ctx.fs_content_cache_file_max = 256 << 10;
+  ctx.fs_stats = 0;
+  ctx.fs_audit_allowed = 0;
+  ctx.fs_trace_hashes = 0;
+  ctx.pool_size = 4;
+  ctx.job_fd = -1;
+  ctx.batch = 0;
+  ctx.batch_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  if (ctx.batch_jobs < 1) {
+    ctx.batch_jobs = 1;
+  }
+  ctx.batch_report_fd = -1;
+  ctx.trace_startup = 0;
+  ctx.cgroup = 0;
+  ctx.cgroup_fuse = 1;
+  ctx.cgroup_fd = -1;
 
   parse_arguments(&ctx, argc, argv);
+  if (!ctx.connect_socket.empty()) {
+    return run_client(&ctx);
+  }
+  if (!ctx.server_socket.empty()) {
+    return run_server(&ctx);
+  }
+  if (!ctx.fs_daemon_socket.empty()) {
+    return run_fs_daemon(&ctx);
+  }
+  if (ctx.trace_startup) {
+    trace_start();
+  }
+  if (!ctx.report_file.empty()) {
+    report_start();
+  }
   if (ctx.fs) {
+    trace_begin("create mount point");
     setup_fuse_context(&ctx);
+    trace_end("create mount point");
+  }
+  int exitcode = run(&ctx);
+  trace_report(ctx.trace_file.c_str());
+  if (!ctx.report_file.empty()) {
+    report_write(ctx.report_file.c_str(), exitcode);
   }
-  return run(&ctx);
+  return exitcode;
 }
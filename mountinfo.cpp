@@ -0,0 +1,113 @@
+/*
+  Copyright (c) 2012 Rohan McGovern <rohan@mcgovern.id.au>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+  LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "mountinfo.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* undo the octal escaping of space, tab, newline and backslash */
+static std::string unescape(const char* in)
+{
+  std::string out;
+  while (*in) {
+    if (in[0] == '\\'
+	&& in[1] >= '0' && in[1] <= '3'
+	&& in[2] >= '0' && in[2] <= '7'
+	&& in[3] >= '0' && in[3] <= '7') {
+      out += char((in[1] - '0') * 64 + (in[2] - '0') * 8 + (in[3] - '0'));
+      in += 4;
+    } else {
+      out += *in++;
+    }
+  }
+  return out;
+}
+
+/*
+  Parse one line:
+  36 35 98:0 /mnt1 /mnt2 rw,noatime master:1 - ext3 /dev/root rw,errors=continue
+*/
+static bool parse_line(char* line, MountInfo* info)
+{
+  std::vector<char*> fields;
+  char* save;
+  for (char* field = strtok_r(line, " \n", &save); field;
+       field = strtok_r(0, " \n", &save)) {
+    fields.push_back(field);
+  }
+
+  /* optional fields end with "-" */
+  size_t sep = 6;
+  while (sep < fields.size() && strcmp(fields[sep], "-")) {
+    ++sep;
+  }
+  if (sep + 2 >= fields.size()) {
+    return false;
+  }
+
+  info->id = atoi(fields[0]);
+  info->parent = atoi(fields[1]);
+  info->root = unescape(fields[3]);
+  info->mountpoint = unescape(fields[4]);
+  info->options = fields[5];
+  info->fstype = unescape(fields[sep + 1]);
+  info->source = unescape(fields[sep + 2]);
+  info->super_options = sep + 3 < fields.size() ? fields[sep + 3] : "";
+  return true;
+}
+
+int read_mountinfo(std::vector<MountInfo>* out)
+{
+  FILE* file = fopen("/proc/self/mountinfo", "r");
+  if (!file) {
+    perror("open /proc/self/mountinfo");
+    return -1;
+  }
+
+  char* line = 0;
+  size_t size = 0;
+  while (-1 != getline(&line, &size, file)) {
+    MountInfo info;
+    if (!parse_line(line, &info)) {
+      fprintf(stderr, "warning: can't parse /proc/self/mountinfo line\n");
+      continue;
+    }
+    out->push_back(info);
+  }
+
+  free(line);
+  fclose(file);
+  return 0;
+}
+
+bool path_is_under(std::string const& path, std::string const& mountpoint)
+{
+  if (mountpoint == "/") {
+    return true;
+  }
+  return path.compare(0, mountpoint.length(), mountpoint) == 0
+    && (path.length() == mountpoint.length()
+	|| path[mountpoint.length()] == '/');
+}
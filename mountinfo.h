@@ -0,0 +1,52 @@
+#ifndef SANDBOX_MOUNTINFO_H
+#define SANDBOX_MOUNTINFO_H
+
+
+/*
+  Copyright (c) 2012 Rohan McGovern <rohan@mcgovern.id.au>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+  LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <string>
+#include <vector>
+
+/* one line of /proc/self/mountinfo */
+struct MountInfo {
+  int id;
+  int parent;
+  std::string root;         /* root of the mount within its filesystem */
+  std::string mountpoint;
+  std::string options;      /* per-mount options, e.g. "rw,nosuid" */
+  std::string fstype;
+  std::string source;
+  std::string super_options;
+};
+
+/*
+  Read the mounts of the calling process, in mount order; returns 0, or -1
+  with an error printed.
+*/
+int read_mountinfo(std::vector<MountInfo>*);
+
+/* true if path is mountpoint, or below it */
+bool path_is_under(std::string const& path, std::string const& mountpoint);
+
+#endif
@@ -0,0 +1,162 @@
+/*
+  Copyright (c) 2012 Rohan McGovern <rohan@mcgovern.id.au>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+  LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mount.h>
+
+#include "kernel_sandbox.h"
+#include "mountinfo.h"
+#include "mounts.h"
+#include "shared.h"
+
+/*
+  Filesystem types to mount afresh inside the sandbox. Through FUSE,
+  device nodes don't work, so /dev and /dev/pts need their own instances;
+  bind and overlay modes bind the originals. With a pid namespace, proc
+  must be mounted again to show the sandbox's processes.
+*/
+static std::vector<std::string> pseudo_types(const Context* ctx)
+{
+  std::vector<std::string> types;
+  if (ctx->fs && ctx->fs_mode == FS_MODE_FUSE) {
+    types.push_back("devtmpfs");
+    types.push_back("devpts");
+  }
+  if (ctx->mount_proc) {
+    types.push_back("proc");
+  }
+  return types;
+}
+
+static int mount_spec(MountSpec const& spec, std::string const& root)
+{
+  std::string target = root + spec.target;
+  const char* path = target.c_str();
+  const char* options = spec.options.empty() ? 0 : spec.options.c_str();
+
+  switch (spec.type) {
+  case MOUNT_TMPFS:
+    debug("mounting tmpfs on %s (%s)\n", path, options ? options : "");
+    if (mount("tmpfs", path, "tmpfs", MS_NOSUID|MS_NODEV, options)) {
+      fprintf(stderr, "mount tmpfs on %s: %s\n", spec.target.c_str(),
+	      strerror(errno));
+      return -1;
+    }
+    break;
+
+  case MOUNT_PROC:
+    debug("mounting proc on %s\n", path);
+    if (mount("proc", path, "proc", MS_NOSUID|MS_NODEV|MS_NOEXEC, 0)) {
+      fprintf(stderr, "mount proc on %s: %s\n", spec.target.c_str(),
+	      strerror(errno));
+      return -1;
+    }
+    break;
+
+  case MOUNT_RO_BIND:
+    debug("binding %s on %s read-only\n", spec.source.c_str(), path);
+    if (bind_readonly_tree(spec.source.c_str(), target)) {
+      return -1;
+    }
+    break;
+
+  default:
+    debug("binding %s on %s\n", spec.source.c_str(), path);
+    if (mount(spec.source.c_str(), path, 0, MS_BIND|MS_REC, 0)) {
+      fprintf(stderr, "bind %s on %s: %s\n", spec.source.c_str(),
+	      spec.target.c_str(), strerror(errno));
+      return -1;
+    }
+    break;
+  }
+
+  /*
+    If the sandbox root is under the bound tree, the bind brought along a
+    copy of the sandbox, with every mount stacked there; remove it.
+  */
+  if (!spec.source.empty() && !root.empty()
+      && path_is_under(root, spec.source)
+      && unmount_stack(target + (spec.source == "/" ? root
+				 : root.substr(spec.source.length())))) {
+    return -1;
+  }
+  return 0;
+}
+
+int mount_filesystems(const Context* ctx, std::string const& root)
+{
+  /*
+    In FUSE mode nothing else has made the namespace's mounts private; do
+    so, or the mounts made here could propagate out of the sandbox.
+  */
+  if (ctx->fs_mode == FS_MODE_FUSE || !ctx->fs) {
+    if (mount(0, "/", 0, MS_REC|MS_PRIVATE, 0)) {
+      perror("make / private");
+      return -1;
+    }
+  }
+
+  std::vector<std::string> types = pseudo_types(ctx);
+  if (!types.empty()) {
+    /* one pass over the mount table finds the mounts of all the types */
+    std::vector<MountInfo> mounts;
+    if (read_mountinfo(&mounts)) {
+      return -1;
+    }
+
+    std::vector<MountInfo const*> to_mount;
+    for (MountInfo const& info : mounts) {
+      if (!root.empty() && path_is_under(info.mountpoint, root)) {
+	continue;
+      }
+      for (std::string const& type : types) {
+	if (info.fstype == type) {
+	  to_mount.push_back(&info);
+	}
+      }
+    }
+
+    for (MountInfo const* info : to_mount) {
+      std::string target = root + info->mountpoint;
+      debug("remount %s (%s) ...\n", target.c_str(), info->fstype.c_str());
+      if (mount(info->fstype.c_str(), target.c_str(), info->fstype.c_str(),
+		0, 0)) {
+	fprintf(stderr, "remount %s: %s\n", info->mountpoint.c_str(),
+		strerror(errno));
+	return -1;
+      }
+    }
+  }
+
+  for (MountSpec const& spec : ctx->mounts) {
+    if (mount_spec(spec, root)) {
+      return -1;
+    }
+  }
+  return 0;
+}
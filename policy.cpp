@@ -0,0 +1,162 @@
+/*
+  Copyright (c) 2012 Rohan McGovern <rohan@mcgovern.id.au>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+  LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "policy.h"
+
+#include <errno.h>
+#include <string.h>
+
+Policy::Policy()
+  : _nodes(1)
+{
+  _nodes[0].rules = 0;
+}
+
+void Policy::hide(std::string const& path)
+{
+  add(path, RULE_HIDE);
+}
+
+void Policy::allow_write(std::string const& path)
+{
+  add(path, RULE_ALLOW_WRITE);
+}
+
+/* insert the components of path into the trie, marking the last with rule */
+void Policy::add(std::string const& path, unsigned rule)
+{
+  int node = 0;
+  size_t pos = 0;
+
+  while (pos < path.length()) {
+    size_t end = path.find('/', pos);
+    if (end == std::string::npos) {
+      end = path.length();
+    }
+    if (end == pos) {
+      ++pos;
+      continue;
+    }
+
+    std::string name = path.substr(pos, end - pos);
+    std::vector<int>& children = _nodes[node].children;
+    std::vector<int>::iterator it = children.begin();
+    while (it != children.end() && _nodes[*it].name < name) {
+      ++it;
+    }
+
+    if (it != children.end() && _nodes[*it].name == name) {
+      node = *it;
+    } else {
+      Node added;
+      added.name = name;
+      added.rules = 0;
+      int index = _nodes.size();
+      children.insert(it, index);
+      // may invalidate `children'
+      _nodes.push_back(added);
+      node = index;
+    }
+
+    pos = end;
+  }
+
+  _nodes[node].rules |= rule;
+}
+
+int Policy::child(int node, const char* name, size_t length) const
+{
+  std::vector<int> const& children = _nodes[node].children;
+  size_t low = 0;
+  size_t high = children.size();
+
+  while (low < high) {
+    size_t mid = (low + high) / 2;
+    int cmp = _nodes[children[mid]].name.compare(0, std::string::npos,
+						  name, length);
+    if (cmp == 0) {
+      return children[mid];
+    }
+    if (cmp < 0) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return -1;
+}
+
+Policy::Cursor Policy::root() const
+{
+  Cursor out = { 0, 0 };
+  if (_nodes[0].rules & RULE_HIDE) {
+    out.flags |= HIDDEN;
+  }
+  return out;
+}
+
+Policy::Cursor Policy::step(Cursor cursor, const char* name,
+			    size_t length) const
+{
+  if (cursor.node == -1) {
+    return cursor;
+  }
+
+  Cursor out = cursor;
+  if (_nodes[cursor.node].rules & RULE_ALLOW_WRITE) {
+    out.flags |= WRITABLE;
+  }
+  out.node = child(cursor.node, name, length);
+  if (out.node != -1 && (_nodes[out.node].rules & RULE_HIDE)) {
+    out.flags |= HIDDEN;
+  }
+  return out;
+}
+
+Policy::Cursor Policy::lookup(const char* path) const
+{
+  Cursor cursor = root();
+
+  while (*path && cursor.node != -1) {
+    if (*path == '/') {
+      ++path;
+      continue;
+    }
+    const char* end = strchrnul(path, '/');
+    cursor = step(cursor, path, end - path);
+    path = end;
+  }
+
+  return cursor;
+}
+
+int Policy::check(Cursor cursor, int write)
+{
+  if (cursor.flags & HIDDEN) {
+    return -ENOENT;
+  }
+  if (write && !(cursor.flags & WRITABLE)) {
+    return -EACCES;
+  }
+  return 0;
+}
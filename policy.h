@@ -0,0 +1,86 @@
+#ifndef SANDBOX_POLICY_H
+#define SANDBOX_POLICY_H
+
+
+/*
+  Copyright (c) 2012 Rohan McGovern <rohan@mcgovern.id.au>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+  LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <string>
+#include <vector>
+
+/*
+  Filesystem access policy: which paths are hidden, and under which paths
+  writes are permitted.
+
+  Rules are compiled into a trie of path components once at startup, so
+  checking a path costs one step per component regardless of the number
+  of rules, and never allocates.
+*/
+class Policy {
+ public:
+  /* flags of a Cursor */
+  enum {
+    HIDDEN = 1,   /* path is at or below a hidden path */
+    WRITABLE = 2  /* path is strictly below a writable path */
+  };
+
+  /* the result of walking some path through the policy */
+  struct Cursor {
+    int node;        /* trie node, or -1 if the path has left the trie */
+    unsigned flags;
+  };
+
+  Policy();
+  void hide(std::string const&);
+  void allow_write(std::string const&);
+
+  Cursor root() const;
+  Cursor step(Cursor, const char* name, size_t length) const;
+  Cursor lookup(const char* path) const;
+
+  /* returns 0 if access is permitted, or a negative errno */
+  static int check(Cursor, int write);
+  inline int check(const char* path, int write) const
+  {
+    return check(lookup(path), write);
+  }
+
+ private:
+  enum {
+    RULE_HIDE = 1,
+    RULE_ALLOW_WRITE = 2
+  };
+
+  struct Node {
+    std::string name;
+    unsigned rules;
+    std::vector<int> children; /* sorted by name */
+  };
+
+  void add(std::string const&, unsigned rule);
+  int child(int node, const char* name, size_t length) const;
+
+  std::vector<Node> _nodes;
+};
+
+#endif
@@ -0,0 +1,213 @@
+/*
+  Copyright (c) 2012 Rohan McGovern <rohan@mcgovern.id.au>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+  LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "read_trace.h"
+#include "sha256.h"
+#include "shared.h"
+
+ReadTrace::ReadTrace()
+  : _hashes(false), _policy(0)
+{
+}
+
+void ReadTrace::start(std::string const& file, bool hashes,
+		      const Policy* policy)
+{
+  _file = file;
+  _hashes = hashes;
+  _policy = policy;
+  std::vector<Set>(SETS).swap(_sets);
+}
+
+void ReadTrace::add(const char* path, int result, unsigned flags)
+{
+  uint64_t h = hash_path(path, strlen(path));
+  Set& s = _sets[h % SETS];
+  std::lock_guard<std::mutex> lock(s.mutex);
+
+  auto range = s.entries.equal_range(h);
+  for (auto it = range.first; it != range.second; ++it) {
+    if (it->second.path == path) {
+      it->second.flags |= flags;
+      return;
+    }
+  }
+
+  Entry entry;
+  entry.path = path;
+  entry.flags = flags;
+  if (result == -ENOENT || result == -ENOTDIR) {
+    entry.flags |= MISSING;
+  }
+  s.entries.insert(std::make_pair(h, entry));
+}
+
+/* SHA-256 of the file, link target or listing at the path, or empty */
+std::string ReadTrace::hash(Item const& item)
+{
+  const char* path = item.path.c_str();
+  struct stat st;
+  if (-1 == lstat(path, &st)) {
+    return std::string();
+  }
+
+  Sha256 sha;
+  if (S_ISREG(st.st_mode)) {
+    int fd = open(path, O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+    if (fd == -1) {
+      return std::string();
+    }
+    char buf[65536];
+    ssize_t got;
+    while ((got = read(fd, buf, sizeof(buf))) > 0) {
+      sha.update(buf, got);
+    }
+    close(fd);
+    if (got == -1) {
+      return std::string();
+    }
+  } else if (S_ISLNK(st.st_mode)) {
+    char target[PATH_MAX];
+    ssize_t length = readlink(path, target, sizeof(target));
+    if (length == -1) {
+      return std::string();
+    }
+    sha.update(target, length);
+  } else if (S_ISDIR(st.st_mode) && (item.flags & LISTED)) {
+    /* the names visible in the sandbox, sorted, each followed by a NUL */
+    DIR* dir = opendir(path);
+    if (!dir) {
+      return std::string();
+    }
+    Policy::Cursor cursor = _policy->lookup(path);
+    std::vector<std::string> names;
+    struct dirent* ent;
+    while ((ent = readdir(dir))) {
+      if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) {
+	continue;
+      }
+      if (cursor.node != -1
+	  && (_policy->step(cursor, ent->d_name, strlen(ent->d_name)).flags
+	      & Policy::HIDDEN)) {
+	continue;
+      }
+      names.push_back(ent->d_name);
+    }
+    closedir(dir);
+    std::sort(names.begin(), names.end());
+    for (std::string const& name : names) {
+      sha.update(name.c_str(), name.length() + 1);
+    }
+  } else {
+    return std::string();
+  }
+  return sha.hex();
+}
+
+void ReadTrace::hash_items(std::vector<Item>* items)
+{
+  std::atomic<size_t> next(0);
+  auto work = [this, items, &next]() {
+    size_t i;
+    while ((i = next++) < items->size()) {
+      Item& item = (*items)[i];
+      if (!(item.flags & MISSING) || item.flags & LISTED) {
+	item.sha256 = hash(item);
+      }
+    }
+  };
+
+  size_t count = std::thread::hardware_concurrency();
+  if (count > items->size()) {
+    count = items->size();
+  }
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < count; ++i) {
+    threads.push_back(std::thread(work));
+  }
+  work();
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+}
+
+void ReadTrace::write()
+{
+  if (!enabled()) {
+    return;
+  }
+
+  std::vector<Item> items;
+  for (Set& s : _sets) {
+    std::lock_guard<std::mutex> lock(s.mutex);
+    for (auto const& it : s.entries) {
+      Item item;
+      item.path = it.second.path;
+      item.flags = it.second.flags;
+      items.push_back(item);
+    }
+  }
+  std::sort(items.begin(), items.end());
+  if (_hashes) {
+    hash_items(&items);
+  }
+
+  /* replace the file atomically, so a reader never sees a partial list */
+  std::string tmp = _file + ".tmp";
+  FILE* out = fopen(tmp.c_str(), "w");
+  if (!out) {
+    fprintf(stderr, "fs-trace-reads: open %s: %s\n", tmp.c_str(),
+	    strerror(errno));
+    return;
+  }
+  for (Item const& item : items) {
+    fprintf(out, "{\"path\": ");
+    write_json_string(out, item.path);
+    fprintf(out, ", \"exists\": %s",
+	    item.flags & MISSING ? "false" : "true");
+    if (item.flags & LISTED) {
+      fprintf(out, ", \"listed\": true");
+    }
+    if (!item.sha256.empty()) {
+      fprintf(out, ", \"sha256\": \"%s\"", item.sha256.c_str());
+    }
+    fprintf(out, "}\n");
+  }
+  if (fclose(out) || rename(tmp.c_str(), _file.c_str())) {
+    fprintf(stderr, "fs-trace-reads: write %s: %s\n", _file.c_str(),
+	    strerror(errno));
+  }
+}
@@ -0,0 +1,116 @@
+#ifndef SANDBOX_READ_TRACE_H
+#define SANDBOX_READ_TRACE_H
+
+
+/*
+  Copyright (c) 2012 Rohan McGovern <rohan@mcgovern.id.au>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+  LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <stdint.h>
+
+#include "policy.h"
+
+/*
+  The set of paths looked up, read or listed through the FUSE process
+  (--fs-trace-reads), including those which didn't exist, for use as a
+  precise list of a command's inputs.
+
+  Like the attribute cache, the set is split into a fixed number of parts,
+  each with its own lock. Noting a path already in the set hashes it and
+  compares it with the entries of the same hash, and never allocates.
+  The set is written out when the FUSE process exits, sorted by path,
+  optionally with hashes of contents computed by a thread for each CPU.
+*/
+class ReadTrace {
+ public:
+  ReadTrace();
+
+  /*
+    Start collecting paths, to be written to file by write(). Hidden
+    entries of policy are left out of the hashes of directory listings.
+  */
+  void start(std::string const& file, bool hashes, const Policy* policy);
+  bool enabled() const { return !_sets.empty(); }
+
+  /* note that path was looked up or read, with result 0 or -errno */
+  inline void record(const char* path, int result)
+  {
+    if (enabled()) {
+      add(path, result, 0);
+    }
+  }
+
+  /* note that directory path was listed */
+  inline void record_listing(const char* path)
+  {
+    if (enabled()) {
+      add(path, 0, LISTED);
+    }
+  }
+
+  void write();
+
+ private:
+  enum {
+    SETS = 64
+  };
+
+  /* flags of an Entry */
+  enum {
+    MISSING = 1,  /* path didn't exist when first looked up */
+    LISTED = 2
+  };
+
+  struct Entry {
+    std::string path;
+    unsigned flags;
+  };
+
+  struct Item {
+    std::string path;
+    unsigned flags;
+    std::string sha256;
+
+    bool operator<(Item const& other) const { return path < other.path; }
+  };
+
+  struct Set {
+    std::mutex mutex;
+    std::unordered_multimap<uint64_t, Entry> entries;
+  };
+
+  void add(const char* path, int result, unsigned flags);
+  void hash_items(std::vector<Item>* items);
+  std::string hash(Item const& item);
+
+  std::string _file;
+  bool _hashes;
+  const Policy* _policy;
+  std::vector<Set> _sets;
+};
+
+#endif
@@ -0,0 +1,174 @@
+/*
+  Copyright (c) 2012 Rohan McGovern <rohan@mcgovern.id.au>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+  LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <new>
+#include <string>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "report.h"
+#include "shared.h"
+#include "stats.h"
+
+namespace {
+
+struct Shared {
+  long processes;
+  int have_fuse;
+  struct rusage fuse_usage;
+  uint64_t fuse_counts[STATS_OP_COUNT];
+  uint64_t fuse_bytes[STATS_OP_COUNT];
+};
+
+Shared* shared = 0;
+struct timespec start;
+
+double seconds(const struct timeval& tv)
+{
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+void save_fuse_stats()
+{
+  stats_totals(shared->fuse_counts, shared->fuse_bytes);
+}
+
+void write_usage(FILE* out, const struct rusage& usage)
+{
+  fprintf(out, "\"user_seconds\": %.6f, \"system_seconds\": %.6f, "
+	  "\"max_rss_kb\": %ld, \"block_input_ops\": %ld, "
+	  "\"block_output_ops\": %ld",
+	  seconds(usage.ru_utime), seconds(usage.ru_stime),
+	  usage.ru_maxrss, usage.ru_inblock, usage.ru_oublock);
+}
+
+void write_json(FILE* out, int exitcode)
+{
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  struct rusage usage;
+  getrusage(RUSAGE_CHILDREN, &usage);
+
+  fprintf(out, "{\"exit_status\": %d, \"wall_seconds\": %.6f, ", exitcode,
+	  (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+  write_usage(out, usage);
+  if (shared->processes >= 0) {
+    fprintf(out, ", \"processes\": %ld", shared->processes);
+  } else {
+    fprintf(out, ", \"processes\": null");
+  }
+
+  if (!shared->have_fuse) {
+    fprintf(out, ", \"fuse\": null}\n");
+    return;
+  }
+
+  uint64_t operations = 0;
+  for (int op = 0; op < STATS_OP_COUNT; ++op) {
+    operations += shared->fuse_counts[op];
+  }
+  fprintf(out, ",\n \"fuse\": {");
+  write_usage(out, shared->fuse_usage);
+  fprintf(out, ", \"operations\": %llu, \"bytes_read\": %llu, "
+	  "\"bytes_written\": %llu,\n  \"counts\": {",
+	  (unsigned long long)operations,
+	  (unsigned long long)shared->fuse_bytes[STATS_READ],
+	  (unsigned long long)shared->fuse_bytes[STATS_WRITE]);
+  const char* sep = "";
+  for (int op = 0; op < STATS_OP_COUNT; ++op) {
+    if (shared->fuse_counts[op]) {
+      fprintf(out, "%s\"%s\": %llu", sep, stats_op_name(op),
+	      (unsigned long long)shared->fuse_counts[op]);
+      sep = ", ";
+    }
+  }
+  fprintf(out, "}}}\n");
+}
+
+}
+
+void report_start()
+{
+  void* memory = mmap(0, sizeof(Shared), PROT_READ|PROT_WRITE,
+		      MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) {
+    perror("report: mmap");
+    return;
+  }
+  shared = new (memory) Shared();
+  shared->processes = -1;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+}
+
+void report_fuse_start()
+{
+  if (!shared) {
+    return;
+  }
+  stats_enabled = 1;
+  atexit(save_fuse_stats);
+}
+
+void report_fuse_usage(const struct rusage* usage)
+{
+  if (!shared) {
+    return;
+  }
+  shared->fuse_usage = *usage;
+  shared->have_fuse = 1;
+}
+
+void report_processes(long count)
+{
+  if (shared) {
+    shared->processes = count;
+  }
+}
+
+int report_write(const char* file, int exitcode)
+{
+  if (!shared) {
+    return -1;
+  }
+
+  /* replace the file atomically, so a reader never sees a partial report */
+  std::string tmp = std::string(file) + ".tmp";
+  FILE* out = fopen(tmp.c_str(), "w");
+  if (!out) {
+    fprintf(stderr, "report: open %s: %s\n", tmp.c_str(), strerror(errno));
+    return -1;
+  }
+  write_json(out, exitcode);
+  if (fclose(out) || rename(tmp.c_str(), file)) {
+    fprintf(stderr, "report: write %s: %s\n", file, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,56 @@
+#ifndef SANDBOX_REPORT_H
+#define SANDBOX_REPORT_H
+
+
+/*
+  Copyright (c) 2012 Rohan McGovern <rohan@mcgovern.id.au>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+  LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+struct rusage;
+
+/*
+  Resource usage report (--report).
+
+  The processes of the sandbox fill in their parts of the report in a page
+  of memory shared with rsandbox, which writes it out at exit. Each call
+  is a no-op unless the report was started.
+*/
+
+/* allocate the shared page and start the clock; call before run() */
+void report_start();
+
+/* in the FUSE process: count operations, and save the totals at exit */
+void report_fuse_start();
+
+/* resources used by the FUSE process, once it has been waited for */
+void report_fuse_usage(const struct rusage* usage);
+
+/* number of processes and threads created in the sandbox */
+void report_processes(long count);
+
+/*
+  Write the report as JSON to file, including the resources used by all
+  waited-for children; returns 0, or -1 with an error printed.
+*/
+int report_write(const char* file, int exitcode);
+
+#endif
@@ -9,7 +9,7 @@ Source:         rsandbox-%{version}.tar.gz
 BuildRequires:  asciidoc
 BuildRequires:  gcc-c++
 BuildRequires:  pkg-config
-BuildRequires:  pkgconfig(fuse)
+BuildRequires:  pkgconfig(fuse3)
 
 %if 0%{?fedora} || 0%{?rhel}
 BuildRequires:  libxslt
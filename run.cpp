@@ -22,100 +22,122 @@
 */
 
 #include "run.h"
+#include "batch.h"
+#include "cgroup.h"
+#include "fs_daemon.h"
 #include "fuse_sandbox.h"
+#include "kernel_sandbox.h"
+#include "mounts.h"
+#include "report.h"
+#include "server.h"
+#include "trace.h"
 
-#include <list>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include <sched.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <sys/mount.h>
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
-#include <mntent.h>
 #include <unistd.h>
 
 int run_children(void*);
 
-/* remount all mounted filesystems of the given type */
-int remount(const char* type)
+/* set if the sandbox must move itself into its cgroup after clone() */
+static int enter_cgroup = 0;
+
+/* namespaces of the sandboxed process, for count_processes() */
+static int counted_clone_flags = 0;
+
+int exec_child(void* arg)
 {
-  debug("attempting to remount filesystems of type %s\n", type);
+  const Context* ctx = reinterpret_cast<const Context*>(arg);
+  trace_process("sandbox");
+  trace_instant("started");
 
-  FILE* file = setmntent("/proc/mounts", "r");
-  if (!file) {
-    perror("setmntent /proc/mounts");
-    return -1;
+  if (enter_cgroup && cgroup_enter(ctx->cgroup_fd)) {
+    return 255;
   }
 
-  struct mntent* ent = getmntent(file);
-  if (!ent) {
-    perror("getmntent");
-    return -1;
+  char cwd[1024];
+  if (ctx->mountns && !getcwd(cwd, sizeof(cwd))) {
+    perror("getcwd");
+    return 255;
   }
-  debug("entering loop\n");
-
-  std::list<std::string> to_mount;
 
-  while (ent) {
-    debug("looking at filesystem %s %s\n", ent->mnt_dir, ent->mnt_type);
-    if (0 == strcmp(ent->mnt_type, type)) {
-      debug("remount %s (%s) ...\n", ent->mnt_dir, type);
-      to_mount.push_back(ent->mnt_dir);
+  if (ctx->fs && ctx->fs_mode != FS_MODE_FUSE) {
+    trace_begin("mount filesystem sandbox");
+    if (start_kernel_sandbox(ctx)) {
+      fprintf(stderr, "Could not initialize filesystem sandbox; aborting.\n");
+      return 255;
     }
-    ent = getmntent(file);
+    trace_end("mount filesystem sandbox");
   }
-  endmntent(file);
 
-  for (auto mountpoint : to_mount) {
-    if (mount(0, mountpoint.c_str(), type, 0, 0)) {
-      fprintf(stderr, "remount %s: %s\n", mountpoint.c_str(), strerror(errno));
-      return -1;
+  if (ctx->mountns) {
+    trace_begin("mount filesystems");
+    if (mount_filesystems(ctx, ctx->fs ? ctx->fuse_mountpoint : "")) {
+      return 255;
     }
+    trace_end("mount filesystems");
   }
 
-  return 0;
-}
-
-int exec_child(void* arg)
-{
-  const Context* ctx = reinterpret_cast<const Context*>(arg);
-
-  /* FIXME: don't hardcode the proc and devtmpfs stuff */
   if (ctx->fs) {
-    char cwd[1024];
-    if (!getcwd(cwd, sizeof(cwd))) {
-      perror("getcwd");
-      return 255;
-    }
+    trace_begin("chroot");
     if (chroot(ctx->fuse_mountpoint.c_str())) {
       perror("chroot");
       return 255;
     }
-    if (chdir(cwd)) {
-      perror("chdir");
-    }
-    if (remount("devtmpfs")) {
+    trace_end("chroot");
+  }
+
+  /* pick up any mounts made over the working directory */
+  if (ctx->mountns && chdir(cwd)) {
+    perror("chdir");
+  }
+
+  if (ctx->batch) {
+    trace_instant("run batch");
+    return run_batch(ctx);
+  }
+
+  if (ctx->job_fd != -1) {
+    /* prepared for --server; the command comes from a client */
+    Job job;
+    if (receive_job(ctx->job_fd, &job)) {
       return 255;
     }
-    if (remount("devpts")) {
-      return 255;
+    if (chdir(job.cwd.c_str())) {
+      perror("chdir");
     }
-  }
 
-  if (ctx->mount_proc) {
-    debug("mounting /proc\n");
-    if (remount("proc")) {
-      return 255;
+    std::vector<char*> argv;
+    for (std::string& arg : job.argv) {
+      argv.push_back(&arg[0]);
+    }
+    argv.push_back(0);
+    std::vector<char*> env;
+    for (std::string& var : job.env) {
+      env.push_back(&var[0]);
     }
+    env.push_back(0);
+
+    environ = env.data();
+    trace_instant("execvp");
+    execvp(argv[0], argv.data());
+    perror("execvp");
+    return 255;
   }
 
   char** argv = (char**)ctx->child_argv;
+  trace_instant("execvp");
   execvp(argv[0], argv);
   perror("execvp");
   return 255;
@@ -126,26 +148,37 @@ int do_nothing(void* arg)
   return 0;
 }
 
-#define test_clone(flags, kernel_config) \
-  test_clone_real(flags, #flags, kernel_config)
-
-int test_clone_real(int flags, const char* flagstr, const char* kernel_config)
+/* namespaces which may be used, for diagnosing clone() failures */
+static const struct Namespace {
+  int flag;
+  const char* name;
+  const char* kernel_config;
+  const char* feature;
+} namespaces[] = {
+  { CLONE_NEWNS, "CLONE_NEWNS", 0, "mounts" },
+  { CLONE_NEWPID, "CLONE_NEWPID", "CONFIG_PID_NS", "process" },
+  { CLONE_NEWNET, "CLONE_NEWNET", "CONFIG_NET_NS", "network" },
+  { CLONE_NEWIPC, "CLONE_NEWIPC", "CONFIG_SYSVIPC and CONFIG_IPC_NS", "IPC" },
+  { 0, 0, 0, 0 }
+};
+
+int test_clone(const Namespace* ns)
 {
   char stack[4096];
-  int pid = clone(do_nothing, stack+sizeof(stack), SIGCHLD|flags, 0);
+  int pid = clone(do_nothing, stack+sizeof(stack), SIGCHLD|ns->flag, 0);
   if (pid == -1) {
     if (errno == EPERM) {
       fprintf(stderr, "error: permission denied for clone() with %s.\n"
-	      "rsandbox should have CAP_SYS_ADMIN capability set.\n", flagstr);
+	      "rsandbox should have CAP_SYS_ADMIN capability set.\n", ns->name);
     } else if (errno == EINVAL) {
       fprintf(stderr, "error: your kernel does not support clone() with %s.\n"
 	      "%s%s%s",
-	      flagstr,
-              kernel_config ? "Kernel should be configured with " : "",
-	      kernel_config,
-	      kernel_config ? ".\n" : "");
+	      ns->name,
+              ns->kernel_config ? "Kernel should be configured with " : "",
+	      ns->kernel_config ? ns->kernel_config : "",
+	      ns->kernel_config ? ".\n" : "");
     } else {
-      fprintf(stderr, "error: clone() with %s failed: %s\n", flagstr,
+      fprintf(stderr, "error: clone() with %s failed: %s\n", ns->name,
 	      strerror(errno));
     }
     return -errno;
@@ -154,54 +187,160 @@ int test_clone_real(int flags, const char* flagstr, const char* kernel_config)
   return 0;
 }
 
-int run(const Context* ctx)
+/*
+  Find and report the namespace which caused clone() with the given flags
+  to fail, or return 0 if none fails alone. Namespaces are only probed
+  after a failure, so that a successful run costs a single clone().
+*/
+const Namespace* diagnose_clone(int flags)
 {
-  int status;
-  if (ctx->clone_for_fuse) {
-    if (test_clone(CLONE_NEWNS, 0)
-	|| test_clone(CLONE_NEWPID, "CONFIG_PID_NS"))
-    {
-      fprintf(stderr, "Could not initialize filesystem sandbox; aborting.\n");
-      return 255;
-    }
-    char stack[16384];
-    int tid = clone(run_children, stack+sizeof(stack),
-		    SIGCHLD|CLONE_NEWNS|CLONE_NEWPID, (void*)ctx);
-    if (tid == -1) {
-      perror("clone");
-      return 255;
+  for (const Namespace* ns = namespaces; ns->flag; ++ns) {
+    if ((flags & ns->flag) && test_clone(ns)) {
+      return ns;
     }
-    if (-1 == waitpid(tid, &status, 0)) {
-      perror("waitpid");
-      return 255;
-    }
-  } else {
-    status = run_children((void*)ctx);
   }
+  return 0;
+}
 
+/* exit code to report for a wait status */
+int exit_code(int status)
+{
   if (WIFEXITED(status)) {
     return WEXITSTATUS(status);
   }
   return 255;
 }
 
+static int run_sandbox(const Context* ctx)
+{
+  if (!ctx->clone_for_fuse) {
+    return run_children((void*)ctx);
+  }
+
+  int flags = CLONE_NEWNS|CLONE_NEWPID;
+  char stack[16384];
+  trace_begin("clone FUSE namespaces");
+  int tid = clone(run_children, stack+sizeof(stack), SIGCHLD|flags,
+		  (void*)ctx);
+  trace_end("clone FUSE namespaces");
+  if (tid == -1) {
+    int error = errno;
+    if (!diagnose_clone(flags)) {
+      fprintf(stderr, "clone: %s\n", strerror(error));
+    }
+    fprintf(stderr, "Could not initialize filesystem sandbox; aborting.\n");
+    return 255;
+  }
+
+  int status;
+  if (-1 == waitpid(tid, &status, 0)) {
+    perror("waitpid");
+    return 255;
+  }
+  return exit_code(status);
+}
+
+int run(const Context* ctx)
+{
+  if (!ctx->cgroup) {
+    return run_sandbox(ctx);
+  }
+
+  /* a cgroup for each sandbox, removed when the sandbox has exited */
+  Context sandbox = *ctx;
+  trace_begin("create cgroup");
+  sandbox.cgroup_fd = cgroup_create(ctx, &sandbox.cgroup_path);
+  trace_end("create cgroup");
+  if (sandbox.cgroup_fd == -1) {
+    fprintf(stderr, "Could not create cgroup; aborting.\n");
+    return 255;
+  }
+
+  int exitcode = run_sandbox(&sandbox);
+  cgroup_remove(sandbox.cgroup_fd, sandbox.cgroup_path);
+  return exitcode;
+}
+
+/*
+  clone() the sandboxed process, starting it in the sandbox's cgroup if
+  there is one. Where the kernel can't clone into a cgroup, the process
+  moves itself in before doing anything else.
+*/
+static int clone_exec_child(const Context* ctx, int flags)
+{
+  if (ctx->cgroup_fd != -1) {
+    int pid = cgroup_clone(flags, ctx->cgroup_fd);
+    if (pid == 0) {
+      _exit(exec_child((void*)ctx));
+    }
+    if (pid != -1 || errno != ENOSYS) {
+      return pid;
+    }
+    debug("clone3 into cgroup unsupported; falling back to clone\n");
+    enter_cgroup = 1;
+  }
+
+  char stack[16384];
+  return clone(exec_child, stack+sizeof(stack), SIGCHLD|flags, (void*)ctx);
+}
+
+/* report why clone() of the sandboxed process with the given flags failed */
+static void clone_failed(int flags)
+{
+  int error = errno;
+  const Namespace* ns = diagnose_clone(flags);
+  if (ns) {
+    fprintf(stderr, "Could not initialize %s sandbox; aborting.\n",
+	    ns->feature);
+  } else {
+    fprintf(stderr, "clone: %s\n", strerror(error));
+  }
+}
+
+/*
+  For --report: pid 1 of a pid namespace holding only the sandbox. Each
+  process and thread of the sandbox also takes a pid in this namespace,
+  so the last pid allocated here counts them.
+*/
+static int count_processes(void* arg)
+{
+  const Context* ctx = reinterpret_cast<const Context*>(arg);
+  int tid = clone_exec_child(ctx, counted_clone_flags);
+  if (tid == -1) {
+    clone_failed(counted_clone_flags);
+    return 255;
+  }
+
+  int status = 255 << 8;
+  if (-1 == waitpid(tid, &status, 0)) {
+    perror("waitpid");
+  }
+
+  FILE* file = fopen("/proc/sys/kernel/ns_last_pid", "r");
+  long last;
+  if (file && 1 == fscanf(file, "%ld", &last)) {
+    report_processes(last - 1);
+  }
+  if (file) {
+    fclose(file);
+  }
+  return exit_code(status);
+}
+
+/* returns the exit code of the command */
 int run_children(void* arg)
 {
   const Context* ctx = reinterpret_cast<const struct Context*>(arg);
-  int clone_flags = SIGCHLD;
+  if (ctx->clone_for_fuse) {
+    trace_process("FUSE namespaces");
+    trace_instant("started");
+  }
+  int clone_flags = 0;
   if (ctx->netns) {
-    if (test_clone(CLONE_NEWNET, "CONFIG_NET_NS")) {
-      fprintf(stderr, "Could not initialize network sandbox; aborting.\n");
-      return 255;
-    }
     clone_flags |= CLONE_NEWNET;
     debug("Using CLONE_NEWNET\n");
   }
   if (ctx->pidns) {
-    if (!ctx->clone_for_fuse && test_clone(CLONE_NEWPID, "CONFIG_PID_NS")) {
-      fprintf(stderr, "Could not initialize process sandbox; aborting.\n");
-      return 255;
-    }
     clone_flags |= CLONE_NEWPID;
     debug("Using CLONE_NEWPID\n");
   }
@@ -209,26 +348,30 @@ int run_children(void* arg)
     if (ctx->clone_for_fuse) {
       debug("Not using CLONE_NEWS; already cloned for FUSE\n");
     } else {
-      if (test_clone(CLONE_NEWNS, 0)) {
-	fprintf(stderr, "Could not initialize mounts sandbox; aborting.\n");
-	return 255;
-      }
       clone_flags |= CLONE_NEWNS;
       debug("Using CLONE_NEWNS\n");
     }
   }
   if (ctx->ipcns) {
-    if (test_clone(CLONE_NEWIPC, "CONFIG_SYSVIPC and CONFIG_IPC_NS")) {
-      fprintf(stderr, "Could not initialize IPC sandbox; aborting.\n");
-      return 255;
-    }
     clone_flags |= CLONE_NEWIPC;
     debug("Using CLONE_NEWIPC\n");
   }
 
   int fuse_pid = 0;
-  if (ctx->fs) {
+  int fuse_daemon = ctx->fs && ctx->fs_mode == FS_MODE_FUSE
+    && !ctx->fs_connect_socket.empty();
+  if (fuse_daemon) {
+    trace_begin("connect to FUSE daemon");
+    int connected = connect_fs_daemon(ctx);
+    trace_end("connect to FUSE daemon");
+    if (connected) {
+      fprintf(stderr, "Could not initialize FUSE; aborting.\n");
+      return 255;
+    }
+  } else if (ctx->fs && ctx->fs_mode == FS_MODE_FUSE) {
+    trace_begin("start FUSE");
     fuse_pid = start_fuse_sandbox(ctx);
+    trace_end("start FUSE");
     if (fuse_pid == -1) {
       fprintf(stderr, "Could not initialize FUSE; aborting.\n");
       return 255;
@@ -236,30 +379,49 @@ int run_children(void* arg)
     debug("fuse PID: %d\n", fuse_pid);
   }
 
-  char stack[16384];
-  int tid = clone(exec_child, stack+sizeof(stack), clone_flags, (void*)ctx);
-  if (tid == -1) {
-    perror("clone");
-    return 255;
+  trace_begin("clone sandbox");
+  int tid;
+  if (!ctx->report_file.empty() && ctx->pidns) {
+    counted_clone_flags = clone_flags;
+    char stack[16384];
+    tid = clone(count_processes, stack+sizeof(stack), SIGCHLD|CLONE_NEWPID,
+		(void*)ctx);
+  } else {
+    tid = clone_exec_child(ctx, clone_flags);
   }
+  trace_end("clone sandbox");
+  int status = 255 << 8;
+  if (tid == -1) {
+    clone_failed(clone_flags);
+  } else {
+    debug("child: %d\n", tid);
 
-  debug("child: %d\n", tid);
+    trace_begin("wait for command");
+    int waited = waitpid(tid, &status, 0);
+    if (waited == -1) {
+      perror("waitpid");
+    }
+    trace_end("wait for command");
 
-  int status;
-  int waited = waitpid(tid, &status, 0);
-  if (waited == -1) {
-    perror("waitpid");
+    debug("waited: %d, status: 0x%x\n", waited, status);
   }
 
-  debug("waited: %d, status: 0x%x\n", waited, status);
+  if (fuse_daemon) {
+    disconnect_fs_daemon(ctx);
+  }
 
   int fuse_status = 0;
   if (fuse_pid) {
+    trace_begin("stop FUSE");
     kill(fuse_pid, SIGTERM);
-    int fuse_waited = waitpid(fuse_pid, &fuse_status, 0);
+    struct rusage fuse_usage;
+    int fuse_waited = wait4(fuse_pid, &fuse_status, 0, &fuse_usage);
     if (fuse_waited == -1) {
       perror("fuse waitpid");
+    } else {
+      report_fuse_usage(&fuse_usage);
     }
+    trace_end("stop FUSE");
   }
 
   if (fuse_status) {
@@ -267,5 +429,5 @@ int run_children(void* arg)
 	    fuse_status);
   }
 
-  return status;
+  return exit_code(status);
 }
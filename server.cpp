@@ -0,0 +1,414 @@
+/*
+  Copyright (c) 2012 Rohan McGovern <rohan@mcgovern.id.au>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+  LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+  Pool of prepared sandboxes (--server) and its client (--connect).
+
+  The server forks --pool-size managers, each sharing the listening
+  socket. A manager sets up a complete sandbox (namespaces, filesystem
+  and chroot) whose child waits on a socketpair, the job socket, rather
+  than running a command. Once the sandbox reports that it's ready, the
+  manager accepts a connection and passes it over the job socket; the
+  sandbox reads the command, its environment, working directory and stdio
+  fds directly from the client, and execs it. When the command exits, its
+  status is returned to the client, and the manager prepares a new
+  sandbox. Sandboxes are never reused.
+
+  If the client goes away while its command is running, the sandbox is
+  killed.
+*/
+
+#include "server.h"
+#include "run.h"
+#include "shared.h"
+#include "sockets.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* messages from a sandbox to its manager on the job socket */
+#define JOB_READY 'R'
+#define JOB_STARTED 'S'
+
+/* largest accepted job (argv, environment and cwd) */
+#define JOB_MAX_SIZE (16 << 20)
+
+/*
+  A job is sent as a 32-bit length with the stdin, stdout and stderr fds
+  attached, followed by that many bytes: the argument and environment
+  counts as 32-bit integers, then the working directory, arguments and
+  environment as NUL-terminated strings.
+*/
+int run_client(const Context* ctx)
+{
+  struct sockaddr_un addr;
+  if (socket_address(ctx->connect_socket, &addr)) {
+    return 255;
+  }
+
+  int sock = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+  if (sock == -1) {
+    perror("socket");
+    return 255;
+  }
+  if (connect(sock, (struct sockaddr*)&addr, sizeof(addr))) {
+    fprintf(stderr, "connect %s: %s\n", ctx->connect_socket.c_str(),
+	    strerror(errno));
+    return 255;
+  }
+
+  char* cwd = getcwd(0, 0);
+  if (!cwd) {
+    perror("getcwd");
+    return 255;
+  }
+
+  uint32_t argc = 0;
+  while (ctx->child_argv[argc]) {
+    ++argc;
+  }
+  uint32_t envc = 0;
+  while (environ[envc]) {
+    ++envc;
+  }
+
+  std::string payload;
+  put_u32(&payload, argc);
+  put_u32(&payload, envc);
+  put_string(&payload, cwd);
+  for (uint32_t i = 0; i < argc; ++i) {
+    put_string(&payload, ctx->child_argv[i]);
+  }
+  for (uint32_t i = 0; i < envc; ++i) {
+    put_string(&payload, environ[i]);
+  }
+  free(cwd);
+
+  uint32_t len = payload.length();
+  const int stdio[3] = { 0, 1, 2 };
+  if (send_fds(sock, &len, sizeof(len), stdio, 3)
+      || send_all(sock, payload.data(), len)) {
+    perror("send job");
+    return 255;
+  }
+
+  int32_t status;
+  if (read_all(sock, &status, sizeof(status))) {
+    fprintf(stderr, "rsandbox: server closed connection\n");
+    return 255;
+  }
+  debug("server: job exited with %d\n", status);
+  return status;
+}
+
+int receive_job(int job_fd, Job* job)
+{
+  char message = JOB_READY;
+  if (-1 == send(job_fd, &message, 1, MSG_NOSIGNAL)) {
+    perror("job: send ready");
+    return -1;
+  }
+
+  int conn;
+  if (recv_fds(job_fd, &message, 1, &conn, 1)) {
+    fprintf(stderr, "job: no connection received\n");
+    return -1;
+  }
+
+  uint32_t len;
+  int stdio[3];
+  if (recv_fds(conn, &len, sizeof(len), stdio, 3)) {
+    fprintf(stderr, "job: no job received\n");
+    return -1;
+  }
+  if (len < 2 * sizeof(uint32_t) || len > JOB_MAX_SIZE) {
+    fprintf(stderr, "job: invalid size %u\n", len);
+    return -1;
+  }
+
+  std::vector<char> payload(len + 1);
+  if (read_all(conn, payload.data(), len)) {
+    fprintf(stderr, "job: short read\n");
+    return -1;
+  }
+  payload[len] = 0;
+  close(conn);
+
+  uint32_t argc, envc;
+  memcpy(&argc, payload.data(), sizeof(argc));
+  memcpy(&envc, payload.data() + sizeof(argc), sizeof(envc));
+
+  const char* p = payload.data() + 2 * sizeof(uint32_t);
+  const char* end = payload.data() + len;
+  std::vector<std::string> strings;
+  while (p < end) {
+    strings.push_back(p);
+    p += strings.back().length() + 1;
+  }
+  if (argc < 1 || strings.size() != 1 + argc + envc) {
+    fprintf(stderr, "job: malformed job\n");
+    return -1;
+  }
+
+  job->cwd = strings[0];
+  job->argv.assign(strings.begin() + 1, strings.begin() + 1 + argc);
+  job->env.assign(strings.begin() + 1 + argc, strings.end());
+
+  for (int i = 0; i < 3; ++i) {
+    if (-1 == dup2(stdio[i], i)) {
+      perror("job: dup2");
+      return -1;
+    }
+    close(stdio[i]);
+  }
+
+  message = JOB_STARTED;
+  send(job_fd, &message, 1, MSG_NOSIGNAL);
+  close(job_fd);
+  return 0;
+}
+
+/* process group of the sandbox being prepared or run by this manager */
+static volatile pid_t runner = 0;
+
+static void manager_terminate(int)
+{
+  if (runner > 0) {
+    kill(-runner, SIGKILL);
+  }
+  _exit(0);
+}
+
+/*
+  Wait for the prepared sandbox on job_fd to be ready, then run one job
+  from the listening socket in it.
+*/
+static void serve_one(int listen_fd, int job_fd)
+{
+  union {
+    char tag;
+    int32_t status;
+  } message;
+
+  ssize_t n = recv(job_fd, &message, sizeof(message), 0);
+  if (n != 1 || message.tag != JOB_READY) {
+    fprintf(stderr, "rsandbox server: could not prepare a sandbox\n");
+    sleep(1);
+    return;
+  }
+  debug("server: sandbox %d ready\n", runner);
+
+  int conn;
+  do {
+    conn = accept4(listen_fd, 0, 0, SOCK_CLOEXEC);
+  } while (conn == -1 && errno == EINTR);
+  if (conn == -1) {
+    perror("accept");
+    return;
+  }
+
+  int32_t status = -1;
+  if (send_fds(job_fd, "J", 1, &conn, 1)) {
+    perror("send connection to sandbox");
+    close(conn);
+    return;
+  }
+
+  /* the sandbox reads the job from conn; don't watch it until it's done */
+  n = recv(job_fd, &message, sizeof(message), 0);
+  if (n == sizeof(status)) {
+    status = message.status;
+  } else if (n != 1) {
+    status = 255;
+  } else {
+    struct pollfd fds[2];
+    fds[0].fd = job_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = conn;
+    fds[1].events = POLLIN;
+
+    while (status == -1) {
+      if (-1 == poll(fds, 2, -1)) {
+	continue;
+      }
+      if (fds[0].revents) {
+	n = recv(job_fd, &message, sizeof(message), 0);
+	status = n == sizeof(status) ? message.status : 255;
+      } else if (fds[1].revents) {
+	/* the client sends nothing more, so this is a disconnect */
+	debug("server: client went away; killing sandbox %d\n", runner);
+	kill(-runner, SIGKILL);
+	break;
+      }
+    }
+  }
+
+  if (status != -1) {
+    send_all(conn, &status, sizeof(status));
+  }
+  close(conn);
+}
+
+static void manager(Context* ctx, int listen_fd)
+{
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = manager_terminate;
+  sigaction(SIGTERM, &sa, 0);
+  sigaction(SIGINT, &sa, 0);
+
+  for (;;) {
+    int sp[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0, sp)) {
+      perror("socketpair");
+      _exit(255);
+    }
+    ctx->job_fd = sp[1];
+
+    pid_t pid = fork();
+    if (pid == -1) {
+      perror("fork");
+      _exit(255);
+    }
+    if (pid == 0) {
+      signal(SIGTERM, SIG_DFL);
+      signal(SIGINT, SIG_DFL);
+      setpgid(0, 0);
+      close(sp[0]);
+      close(listen_fd);
+      int32_t status = run(ctx);
+      send(sp[1], &status, sizeof(status), MSG_NOSIGNAL);
+      _exit(0);
+    }
+    setpgid(pid, pid);
+    runner = pid;
+    close(sp[1]);
+
+    serve_one(listen_fd, sp[0]);
+
+    close(sp[0]);
+    kill(-pid, SIGKILL);
+    waitpid(pid, 0, 0);
+    runner = 0;
+  }
+}
+
+static volatile sig_atomic_t stopping = 0;
+
+static void server_terminate(int)
+{
+  stopping = 1;
+}
+
+int run_server(const Context* ctx)
+{
+  struct sockaddr_un addr;
+  if (socket_address(ctx->server_socket, &addr)) {
+    return 255;
+  }
+
+  /* only this user may run commands in our sandboxes */
+  int listen_fd = listen_socket(addr);
+  if (listen_fd == -1) {
+    return 255;
+  }
+
+  /* each sandbox in the pool needs its own root */
+  std::vector<Context> slots(ctx->pool_size, *ctx);
+  for (Context& slot : slots) {
+    if (!slot.fs) {
+      continue;
+    }
+    const char* tempdir = getenv("TMPDIR");
+    std::string tmpl = std::string(tempdir ? tempdir : "/tmp")
+      + "/rsandbox-fuse-XXXXXX";
+    if (!mkdtemp(&tmpl[0])) {
+      perror("Can't create mount point for FUSE");
+      return 3;
+    }
+    slot.fuse_mountpoint = tmpl;
+  }
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = server_terminate;
+  sigaction(SIGTERM, &sa, 0);
+  sigaction(SIGINT, &sa, 0);
+
+  std::vector<pid_t> managers(slots.size(), 0);
+  while (!stopping) {
+    for (size_t i = 0; i < slots.size(); ++i) {
+      if (managers[i]) {
+	continue;
+      }
+      pid_t pid = fork();
+      if (pid == -1) {
+	perror("fork");
+	break;
+      }
+      if (pid == 0) {
+	manager(&slots[i], listen_fd);
+      }
+      managers[i] = pid;
+    }
+
+    int status;
+    pid_t pid = wait(&status);
+    for (size_t i = 0; pid > 0 && i < managers.size(); ++i) {
+      if (managers[i] == pid) {
+	managers[i] = 0;
+	if (!stopping) {
+	  fprintf(stderr, "rsandbox server: manager %d exited with status "
+		  "0x%x\n", pid, status);
+	  sleep(1);
+	}
+      }
+    }
+  }
+
+  debug("server: stopping\n");
+  for (pid_t pid : managers) {
+    if (pid) {
+      kill(pid, SIGTERM);
+      waitpid(pid, 0, 0);
+    }
+  }
+  for (Context const& slot : slots) {
+    if (slot.fs && rmdir(slot.fuse_mountpoint.c_str())) {
+      fprintf(stderr, "warning: could not remove %s: %s\n",
+	      slot.fuse_mountpoint.c_str(), strerror(errno));
+    }
+  }
+  unlink(addr.sun_path);
+  return 0;
+}
@@ -0,0 +1,59 @@
+#ifndef SANDBOX_SERVER_H
+#define SANDBOX_SERVER_H
+
+
+/*
+  Copyright (c) 2012 Rohan McGovern <rohan@mcgovern.id.au>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+  LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <string>
+#include <vector>
+
+struct Context;
+
+/* a command to run in a prepared sandbox */
+struct Job {
+  std::vector<std::string> argv;
+  std::vector<std::string> env;
+  std::string cwd;
+};
+
+/*
+  --server: accept commands on a Unix socket, running each in one of a
+  pool of sandboxes prepared in advance. Returns when terminated.
+*/
+int run_server(const Context*);
+
+/*
+  --connect: run ctx->child_argv in a sandbox from the server, with this
+  process's stdio, environment and working directory; returns the exit
+  status of the command.
+*/
+int run_client(const Context*);
+
+/*
+  Called in a prepared sandbox: tell the server the sandbox is ready, wait
+  for a job and install its stdio. Returns 0, or -1 with an error printed.
+*/
+int receive_job(int job_fd, Job* job);
+
+#endif
@@ -39,3 +39,27 @@ void debug(const char* format, ...)
   vfprintf(stderr, format, ap);
   va_end(ap);
 }
+
+void write_json_string(FILE* out, std::string const& str)
+{
+  fputc('"', out);
+  for (unsigned char c : str) {
+    if (c == '"' || c == '\\') {
+      fprintf(out, "\\%c", c);
+    } else if (c < 0x20) {
+      fprintf(out, "\\u%04x", c);
+    } else {
+      fputc(c, out);
+    }
+  }
+  fputc('"', out);
+}
+
+uint64_t hash_path(const char* path, size_t length)
+{
+  uint64_t out = 14695981039346656037ULL;
+  for (size_t i = 0; i < length; ++i) {
+    out = (out ^ (unsigned char)path[i]) * 1099511628211ULL;
+  }
+  return out;
+}
@@ -26,9 +26,49 @@
 
 #include <string>
 #include <list>
+#include <vector>
+
+#include <stdint.h>
+#include <stdio.h>
 
 #define APPNAME "rsandbox"
 
+/* kernel caching behaviour for the FUSE filesystem (--fs-cache) */
+enum FsCache {
+  FS_CACHE_NONE,
+  FS_CACHE_AUTO,
+  FS_CACHE_AGGRESSIVE
+};
+
+/* implementation of the FUSE filesystem (--fs-engine) */
+enum FsEngine {
+  FS_ENGINE_PATH,
+  FS_ENGINE_INODE
+};
+
+/* implementation of the filesystem sandbox (--fs-mode) */
+enum FsMode {
+  FS_MODE_FUSE,
+  FS_MODE_BIND,
+  FS_MODE_OVERLAY
+};
+
+/* kinds of mount given on the command line (--tmpfs, --bind, ...) */
+enum MountType {
+  MOUNT_TMPFS,
+  MOUNT_BIND,
+  MOUNT_RO_BIND,
+  MOUNT_PROC
+};
+
+/* a mount to make in the sandbox; target is a path within the sandbox */
+struct MountSpec {
+  int type;
+  std::string source;
+  std::string target;
+  std::string options;
+};
+
 struct Global {
   static int debug_mode;
 };
@@ -41,11 +81,61 @@ struct Context {
   unsigned fs :1;
   unsigned mount_proc :1;
   unsigned clone_for_fuse :1;
+  unsigned fs_stats :1;
+  unsigned batch :1;
+  unsigned trace_startup :1;
+  unsigned cgroup :1;
+  unsigned cgroup_fuse :1;
+  unsigned fs_uring :1;
+  unsigned fs_writeback_cache :1;
+  unsigned fs_audit_allowed :1;
+  unsigned fs_trace_hashes :1;
+  int fs_cache;
+  int fs_mode;
+  int fs_engine;
+  int fs_threads;
+  int fs_max_idle_threads;
+  int fs_max_background;
+  unsigned fs_max_write;
+  unsigned fs_max_read;
+  unsigned fs_max_readahead;
+  size_t fs_content_cache;
+  size_t fs_content_cache_file_max;
+  double fs_attr_cache_ttl;
   char** child_argv;
   std::string fuse_mountpoint;
+  std::string fs_stats_file;
+  std::string fs_audit_file;
+  std::string fs_trace_reads_file;
+  std::string fs_upper;
+  std::string trace_file;
+  std::string report_file;
+  std::string server_socket;
+  std::string connect_socket;
+  std::string fs_daemon_socket;
+  std::string fs_connect_socket;
+  int pool_size;
+  int job_fd;
+  std::vector<std::string> batch_commands;
+  int batch_jobs;
+  int batch_report_fd;
   std::list<std::string> fuse_writable_paths;
+  std::vector<MountSpec> mounts;
+  std::string cgroup_parent;
+  std::string memory_max;
+  std::string cpu_max;
+  std::string pids_max;
+  std::vector<std::string> io_max;
+  std::string cgroup_path;
+  int cgroup_fd;
 };
 
 void debug(const char*, ...);
 
+/* write a string to a JSON document, quoted and escaped */
+void write_json_string(FILE*, std::string const&);
+
+/* FNV-1a hash of the first length bytes of path */
+uint64_t hash_path(const char* path, size_t length);
+
 #endif
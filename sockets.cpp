@@ -0,0 +1,205 @@
+/*
+  Copyright (c) 2012 Rohan McGovern <rohan@mcgovern.id.au>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+  LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "sockets.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+int send_all(int sock, const void* data, size_t len)
+{
+  const char* p = (const char*)data;
+  while (len) {
+    ssize_t n = send(sock, p, len, MSG_NOSIGNAL);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/* returns 0, or -1 on error or end of file */
+int read_all(int fd, void* data, size_t len)
+{
+  char* p = (char*)data;
+  while (len) {
+    ssize_t n = read(fd, p, len);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+int send_fds(int sock, const void* data, size_t len,
+		    const int* fds, int nfds)
+{
+  struct iovec iov;
+  iov.iov_base = (void*)data;
+  iov.iov_len = len;
+
+  char control[CMSG_SPACE(sizeof(int) * 3)];
+  memset(control, 0, sizeof(control));
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+
+  ssize_t n;
+  do {
+    n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+  } while (n == -1 && errno == EINTR);
+  return n == ssize_t(len) ? 0 : -1;
+}
+
+/* close every fd received in the control messages of msg */
+static void close_received_fds(struct msghdr* msg)
+{
+  for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg); cmsg;
+       cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+      continue;
+    }
+    int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (int i = 0; i < count; ++i) {
+      int fd;
+      memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+      close(fd);
+    }
+  }
+}
+
+/*
+  receive len bytes, with exactly nfds fds attached to the first of them;
+  on failure, no fds are left open
+*/
+int recv_fds(int sock, void* data, size_t len, int* fds, int nfds)
+{
+  struct iovec iov;
+  iov.iov_base = data;
+  iov.iov_len = len;
+
+  char control[CMSG_SPACE(sizeof(int) * 3)];
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+
+  ssize_t n;
+  do {
+    n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+  } while (n == -1 && errno == EINTR);
+  if (n <= 0) {
+    return -1;
+  }
+
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  if ((msg.msg_flags & MSG_CTRUNC) || !cmsg
+      || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+      || cmsg->cmsg_len != CMSG_LEN(sizeof(int) * nfds)) {
+    close_received_fds(&msg);
+    return -1;
+  }
+  memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * nfds);
+
+  if (read_all(sock, (char*)data + n, len - n)) {
+    for (int i = 0; i < nfds; ++i) {
+      close(fds[i]);
+    }
+    return -1;
+  }
+  return 0;
+}
+
+int socket_address(std::string const& path, struct sockaddr_un* addr)
+{
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (path.length() >= sizeof(addr->sun_path)) {
+    fprintf(stderr, "socket path too long: %s\n", path.c_str());
+    return -1;
+  }
+  strcpy(addr->sun_path, path.c_str());
+  return 0;
+}
+
+void put_u32(std::string* out, uint32_t value)
+{
+  out->append((const char*)&value, sizeof(value));
+}
+
+void put_string(std::string* out, const char* value)
+{
+  out->append(value, strlen(value) + 1);
+}
+
+int listen_socket(struct sockaddr_un const& addr)
+{
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+  if (listen_fd == -1) {
+    perror("socket");
+    return -1;
+  }
+
+  /* replace a socket left by a previous server, but nothing else */
+  struct stat st;
+  if (0 == lstat(addr.sun_path, &st) && S_ISSOCK(st.st_mode)) {
+    unlink(addr.sun_path);
+  }
+
+  /* only this user may connect */
+  mode_t old_umask = umask(077);
+  int bound = bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr));
+  umask(old_umask);
+  if (bound || listen(listen_fd, SOMAXCONN)) {
+    fprintf(stderr, "listen on %s: %s\n", addr.sun_path, strerror(errno));
+    close(listen_fd);
+    return -1;
+  }
+  return listen_fd;
+}
@@ -0,0 +1,61 @@
+#ifndef SANDBOX_SOCKETS_H
+#define SANDBOX_SOCKETS_H
+
+
+/*
+  Copyright (c) 2012 Rohan McGovern <rohan@mcgovern.id.au>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+  LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/un.h>
+
+#include <string>
+
+/*
+  Helpers for the Unix sockets of --server and --fs-daemon. Functions
+  returning int return 0, or -1 with errno set.
+*/
+
+/* send or read exactly len bytes; end of file is an error */
+int send_all(int sock, const void* data, size_t len);
+int read_all(int fd, void* data, size_t len);
+
+/* send or receive len bytes, with nfds (at most 3) fds attached */
+int send_fds(int sock, const void* data, size_t len, const int* fds, int nfds);
+int recv_fds(int sock, void* data, size_t len, int* fds, int nfds);
+
+/* prints an error and returns -1 if path is too long */
+int socket_address(std::string const& path, struct sockaddr_un* addr);
+
+/*
+  Listen on addr, replacing any socket already there; only this user may
+  connect. Returns the listening fd, or -1 with an error printed.
+*/
+int listen_socket(struct sockaddr_un const& addr);
+
+/* append to a message */
+void put_u32(std::string* out, uint32_t value);
+void put_string(std::string* out, const char* value);
+
+#endif
@@ -0,0 +1,337 @@
+/*
+  Copyright (c) 2012 Rohan McGovern <rohan@mcgovern.id.au>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+  LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "stats.h"
+#include "shared.h"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+
+/* bucket i counts operations taking [2^i, 2^(i+1)) ns; the last is open */
+#define STATS_BUCKETS 40
+
+static const char* const op_names[STATS_OP_COUNT] = {
+  "access",
+  "chmod",
+  "chown",
+  "create",
+  "flush",
+  "forget",
+  "fsync",
+  "getattr",
+  "getxattr",
+  "link",
+  "listxattr",
+  "lookup",
+  "mkdir",
+  "mknod",
+  "open",
+  "opendir",
+  "read",
+  "readdir",
+  "readdirplus",
+  "readlink",
+  "release",
+  "releasedir",
+  "removexattr",
+  "rename",
+  "rmdir",
+  "setattr",
+  "setxattr",
+  "statfs",
+  "symlink",
+  "truncate",
+  "unlink",
+  "utimens",
+  "write",
+};
+
+/*
+  Counters are only written by the owning thread; they're atomic so that
+  a report may read them while the thread is running.
+*/
+struct OpStats {
+  std::atomic<uint64_t> count;
+  std::atomic<uint64_t> bytes;
+  std::atomic<uint64_t> nanoseconds;
+  std::atomic<uint64_t> max;
+  std::atomic<uint64_t> buckets[STATS_BUCKETS];
+};
+
+struct ThreadStats {
+  OpStats ops[STATS_OP_COUNT];
+};
+
+/* plain totals over all threads */
+struct OpTotals {
+  uint64_t count;
+  uint64_t bytes;
+  uint64_t nanoseconds;
+  uint64_t max;
+  uint64_t buckets[STATS_BUCKETS];
+};
+
+int stats_enabled = 0;
+
+static std::string report_file;
+static std::mutex threads_mutex;
+static std::vector<ThreadStats*> threads;
+static ThreadStats retired;  /* counts of exited threads */
+static thread_local ThreadStats* thread_stats;
+
+/* add to a counter which has no other writers, without a locked operation */
+static inline void add(std::atomic<uint64_t>& counter, uint64_t value)
+{
+  counter.store(counter.load(std::memory_order_relaxed) + value,
+		std::memory_order_relaxed);
+}
+
+/* adds the thread's counts to retired and frees them when the thread exits */
+static thread_local struct StatsOwner {
+  ~StatsOwner()
+  {
+    if (!thread_stats) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(threads_mutex);
+    for (int op = 0; op < STATS_OP_COUNT; ++op) {
+      OpStats& stats = thread_stats->ops[op];
+      OpStats& total = retired.ops[op];
+      add(total.count, stats.count.load(std::memory_order_relaxed));
+      add(total.bytes, stats.bytes.load(std::memory_order_relaxed));
+      add(total.nanoseconds,
+	  stats.nanoseconds.load(std::memory_order_relaxed));
+      uint64_t max = stats.max.load(std::memory_order_relaxed);
+      if (max > total.max.load(std::memory_order_relaxed)) {
+	total.max.store(max, std::memory_order_relaxed);
+      }
+      for (int i = 0; i < STATS_BUCKETS; ++i) {
+	add(total.buckets[i], stats.buckets[i].load(std::memory_order_relaxed));
+      }
+    }
+    threads.erase(std::find(threads.begin(), threads.end(), thread_stats));
+    delete thread_stats;
+    thread_stats = 0;
+  }
+} stats_owner;
+
+void stats_record(int op, uint64_t nanoseconds, uint64_t bytes)
+{
+  if (!thread_stats) {
+    (void)&stats_owner;
+    thread_stats = new ThreadStats();
+    std::lock_guard<std::mutex> lock(threads_mutex);
+    threads.push_back(thread_stats);
+  }
+
+  OpStats& stats = thread_stats->ops[op];
+  add(stats.count, 1);
+  add(stats.bytes, bytes);
+  add(stats.nanoseconds, nanoseconds);
+  if (nanoseconds > stats.max.load(std::memory_order_relaxed)) {
+    stats.max.store(nanoseconds, std::memory_order_relaxed);
+  }
+
+  int bucket = nanoseconds ? 63 - __builtin_clzll(nanoseconds) : 0;
+  if (bucket >= STATS_BUCKETS) {
+    bucket = STATS_BUCKETS - 1;
+  }
+  add(stats.buckets[bucket], 1);
+}
+
+static void sum(OpTotals* totals)
+{
+  memset(totals, 0, sizeof(OpTotals) * STATS_OP_COUNT);
+
+  std::lock_guard<std::mutex> lock(threads_mutex);
+  std::vector<ThreadStats*> all(threads);
+  all.push_back(&retired);
+  for (ThreadStats* thread : all) {
+    for (int op = 0; op < STATS_OP_COUNT; ++op) {
+      OpStats& stats = thread->ops[op];
+      OpTotals& total = totals[op];
+      total.count += stats.count.load(std::memory_order_relaxed);
+      total.bytes += stats.bytes.load(std::memory_order_relaxed);
+      total.nanoseconds += stats.nanoseconds.load(std::memory_order_relaxed);
+      uint64_t max = stats.max.load(std::memory_order_relaxed);
+      if (max > total.max) {
+	total.max = max;
+      }
+      for (int i = 0; i < STATS_BUCKETS; ++i) {
+	total.buckets[i] += stats.buckets[i].load(std::memory_order_relaxed);
+      }
+    }
+  }
+}
+
+/* upper bound of the bucket containing the given fraction of operations */
+static uint64_t percentile(const OpTotals& total, double fraction)
+{
+  uint64_t wanted = total.count * fraction;
+  uint64_t seen = 0;
+  for (int i = 0; i < STATS_BUCKETS - 1; ++i) {
+    seen += total.buckets[i];
+    if (seen > wanted) {
+      return 2ULL << i;
+    }
+  }
+  return total.max;
+}
+
+static void write_text(FILE* out, const OpTotals* totals)
+{
+  fprintf(out, APPNAME ": filesystem statistics (latencies in us; "
+	  "percentiles are bucket upper bounds)\n");
+  fprintf(out, "%-12s %10s %14s %12s %9s %9s %9s %9s\n",
+	  "operation", "count", "bytes", "total ms", "mean", "p50", "p99",
+	  "max");
+  for (int op = 0; op < STATS_OP_COUNT; ++op) {
+    const OpTotals& total = totals[op];
+    if (!total.count) {
+      continue;
+    }
+    fprintf(out, "%-12s %10llu %14llu %12.1f %9.1f %9.1f %9.1f %9.1f\n",
+	    op_names[op],
+	    (unsigned long long)total.count,
+	    (unsigned long long)total.bytes,
+	    total.nanoseconds / 1e6,
+	    total.nanoseconds / 1e3 / total.count,
+	    percentile(total, 0.5) / 1e3,
+	    percentile(total, 0.99) / 1e3,
+	    total.max / 1e3);
+  }
+}
+
+static void write_json(FILE* out, const OpTotals* totals)
+{
+  fprintf(out, "{\"operations\": {");
+  const char* sep = "";
+  for (int op = 0; op < STATS_OP_COUNT; ++op) {
+    const OpTotals& total = totals[op];
+    if (!total.count) {
+      continue;
+    }
+    fprintf(out, "%s\n  \"%s\": {\"count\": %llu, \"bytes\": %llu, "
+	    "\"total_ns\": %llu, \"max_ns\": %llu, \"histogram\": [",
+	    sep, op_names[op],
+	    (unsigned long long)total.count,
+	    (unsigned long long)total.bytes,
+	    (unsigned long long)total.nanoseconds,
+	    (unsigned long long)total.max);
+    sep = ",";
+
+    /* non-empty buckets, as [upper bound in ns, count] */
+    const char* bucket_sep = "";
+    for (int i = 0; i < STATS_BUCKETS; ++i) {
+      if (total.buckets[i]) {
+	fprintf(out, "%s[%llu, %llu]", bucket_sep,
+		i == STATS_BUCKETS - 1 ? 0ULL : 2ULL << i,
+		(unsigned long long)total.buckets[i]);
+	bucket_sep = ", ";
+      }
+    }
+    fprintf(out, "]}");
+  }
+  fprintf(out, "\n}}\n");
+}
+
+void stats_report()
+{
+  static std::mutex report_mutex;
+  std::lock_guard<std::mutex> lock(report_mutex);
+
+  static OpTotals totals[STATS_OP_COUNT];
+  sum(totals);
+
+  if (report_file.empty()) {
+    write_text(stderr, totals);
+    return;
+  }
+
+  /* replace the file atomically, so a reader never sees a partial report */
+  std::string tmp = report_file + ".tmp";
+  FILE* out = fopen(tmp.c_str(), "w");
+  if (!out) {
+    fprintf(stderr, "fs-stats: open %s: %s\n", tmp.c_str(), strerror(errno));
+    return;
+  }
+  write_json(out, totals);
+  if (fclose(out) || rename(tmp.c_str(), report_file.c_str())) {
+    fprintf(stderr, "fs-stats: write %s: %s\n", report_file.c_str(),
+	    strerror(errno));
+  }
+}
+
+static void report_on_signal()
+{
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+
+  int sig;
+  while (0 == sigwait(&set, &sig)) {
+    stats_report();
+  }
+}
+
+const char* stats_op_name(int op)
+{
+  return op_names[op];
+}
+
+void stats_totals(uint64_t counts[STATS_OP_COUNT],
+		  uint64_t bytes[STATS_OP_COUNT])
+{
+  OpTotals totals[STATS_OP_COUNT];
+  sum(totals);
+  for (int op = 0; op < STATS_OP_COUNT; ++op) {
+    counts[op] = totals[op].count;
+    bytes[op] = totals[op].bytes;
+  }
+}
+
+void stats_start(const char* file)
+{
+  report_file = file;
+  stats_enabled = 1;
+  atexit(stats_report);
+
+  /* handled only by the reporting thread; inherited by all other threads */
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &set, 0);
+
+  std::thread(report_on_signal).detach();
+}
@@ -0,0 +1,132 @@
+#ifndef SANDBOX_STATS_H
+#define SANDBOX_STATS_H
+
+
+/*
+  Copyright (c) 2012 Rohan McGovern <rohan@mcgovern.id.au>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+  LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+  Per-operation statistics for the FUSE process (--fs-stats).
+
+  Each thread counts into its own block, so recording an operation costs
+  two clock reads and a few uncontended relaxed atomic adds. Blocks are
+  only summed when a report is written.
+*/
+
+enum StatsOp {
+  STATS_ACCESS,
+  STATS_CHMOD,
+  STATS_CHOWN,
+  STATS_CREATE,
+  STATS_FLUSH,
+  STATS_FORGET,
+  STATS_FSYNC,
+  STATS_GETATTR,
+  STATS_GETXATTR,
+  STATS_LINK,
+  STATS_LISTXATTR,
+  STATS_LOOKUP,
+  STATS_MKDIR,
+  STATS_MKNOD,
+  STATS_OPEN,
+  STATS_OPENDIR,
+  STATS_READ,
+  STATS_READDIR,
+  STATS_READDIRPLUS,
+  STATS_READLINK,
+  STATS_RELEASE,
+  STATS_RELEASEDIR,
+  STATS_REMOVEXATTR,
+  STATS_RENAME,
+  STATS_RMDIR,
+  STATS_SETATTR,
+  STATS_SETXATTR,
+  STATS_STATFS,
+  STATS_SYMLINK,
+  STATS_TRUNCATE,
+  STATS_UNLINK,
+  STATS_UTIMENS,
+  STATS_WRITE,
+  STATS_OP_COUNT
+};
+
+/* nonzero if statistics are being collected */
+extern int stats_enabled;
+
+/*
+  Start collecting statistics. The report is written to file as JSON, or
+  to stderr as text if file is empty, by stats_report() and on SIGUSR1.
+  Must be called before any other threads are started.
+*/
+void stats_start(const char* file);
+
+void stats_record(int op, uint64_t nanoseconds, uint64_t bytes);
+
+void stats_report();
+
+/* name of an operation, as in reports */
+const char* stats_op_name(int op);
+
+/* count and bytes of each operation so far, summed over all threads */
+void stats_totals(uint64_t counts[STATS_OP_COUNT],
+		  uint64_t bytes[STATS_OP_COUNT]);
+
+/* times the enclosing scope as one operation */
+struct StatsTimer {
+  int op;
+  uint64_t bytes;
+  struct timespec start;
+
+  StatsTimer(int op) : op(op), bytes(0)
+  {
+    if (stats_enabled) {
+      clock_gettime(CLOCK_MONOTONIC, &start);
+    }
+  }
+
+  ~StatsTimer()
+  {
+    if (stats_enabled) {
+      struct timespec end;
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      stats_record(op, (end.tv_sec - start.tv_sec) * 1000000000ULL
+		   + end.tv_nsec - start.tv_nsec, bytes);
+    }
+  }
+};
+
+#define STATS_TIMER(op) StatsTimer stats_timer(op)
+
+/* count bytes transferred by the operation, if result is not an error */
+#define STATS_BYTES(result)			\
+  do {						\
+    if ((result) > 0) {				\
+      stats_timer.bytes = (result);		\
+    }						\
+  } while(0)
+
+#endif
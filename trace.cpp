@@ -0,0 +1,205 @@
+/*
+  Copyright (c) 2012 Rohan McGovern <rohan@mcgovern.id.au>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+  LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <atomic>
+#include <new>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "shared.h"
+#include "trace.h"
+
+#define TRACE_MAX_EVENTS 1024
+
+namespace {
+
+struct Event {
+  uint64_t nanoseconds;
+  char phase;
+  char process[23];
+  char name[48];
+};
+
+/* shared between all the processes; events past the end are dropped */
+struct Buffer {
+  std::atomic<unsigned> count;
+  uint64_t start;
+  Event events[TRACE_MAX_EVENTS];
+};
+
+Buffer* buffer = 0;
+const char* process = "rsandbox";
+
+uint64_t now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void record(char phase, const char* name)
+{
+  if (!buffer) {
+    return;
+  }
+  uint64_t time = now();
+  unsigned i = buffer->count.fetch_add(1, std::memory_order_relaxed);
+  if (i >= TRACE_MAX_EVENTS) {
+    return;
+  }
+  Event& event = buffer->events[i];
+  event.nanoseconds = time - buffer->start;
+  event.phase = phase;
+  strncpy(event.process, process, sizeof(event.process) - 1);
+  strncpy(event.name, name, sizeof(event.name) - 1);
+}
+
+const char* phase_name(char phase)
+{
+  switch (phase) {
+  case 'B':
+    return "begin";
+  case 'E':
+    return "end";
+  default:
+    return "";
+  }
+}
+
+/* pid for the Chrome format: the order in which a process first appears */
+int process_id(const Event* events, unsigned count, const Event& event)
+{
+  for (unsigned i = 0; i < count; ++i) {
+    if (!strcmp(events[i].process, event.process)) {
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
+}
+
+void trace_start()
+{
+  void* memory = mmap(0, sizeof(Buffer), PROT_READ|PROT_WRITE,
+		      MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) {
+    perror("trace-startup: mmap");
+    return;
+  }
+  buffer = new (memory) Buffer;
+  buffer->count = 0;
+  buffer->start = now();
+  trace_instant("start");
+}
+
+void trace_process(const char* name)
+{
+  process = name;
+}
+
+void trace_begin(const char* name)
+{
+  record('B', name);
+}
+
+void trace_end(const char* name)
+{
+  record('E', name);
+}
+
+void trace_instant(const char* name)
+{
+  record('i', name);
+}
+
+void trace_report(const char* file)
+{
+  if (!buffer) {
+    return;
+  }
+
+  unsigned count = buffer->count.load();
+  if (count > TRACE_MAX_EVENTS) {
+    fprintf(stderr, "trace-startup: %u events dropped\n",
+	    count - TRACE_MAX_EVENTS);
+    count = TRACE_MAX_EVENTS;
+  }
+  const Event* events = buffer->events;
+
+  /*
+    Events are recorded in order of their index, which may differ slightly
+    from the order of their timestamps across processes.
+  */
+  unsigned order[TRACE_MAX_EVENTS];
+  for (unsigned i = 0; i < count; ++i) {
+    unsigned j = i;
+    for (; j && events[order[j-1]].nanoseconds > events[i].nanoseconds; --j) {
+      order[j] = order[j-1];
+    }
+    order[j] = i;
+  }
+
+  if (!*file) {
+    fprintf(stderr, "rsandbox: startup trace (ms):\n");
+    for (unsigned i = 0; i < count; ++i) {
+      const Event& event = events[order[i]];
+      fprintf(stderr, "%10.3f  %-14s %-5s  %s\n", event.nanoseconds / 1e6,
+	      event.process, phase_name(event.phase), event.name);
+    }
+    return;
+  }
+
+  FILE* out = fopen(file, "w");
+  if (!out) {
+    fprintf(stderr, "trace-startup: open %s: %s\n", file, strerror(errno));
+    return;
+  }
+  fprintf(out, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+  for (unsigned i = 0; i < count; ++i) {
+    const Event& event = events[i];
+    int pid = process_id(events, count, event);
+    if (process_id(events, i, event) != pid) {
+      /* first event of this process; name it */
+      fprintf(out, "%s\n  {\"ph\": \"M\", \"name\": \"process_name\", "
+	      "\"pid\": %d, \"tid\": %d, \"args\": {\"name\": ",
+	      i ? "," : "", pid, pid);
+      write_json_string(out, event.process);
+      fprintf(out, "}}");
+    }
+    fprintf(out, ",\n  {\"ph\": \"%c\", \"name\": ", event.phase);
+    write_json_string(out, event.name);
+    fprintf(out, ", \"pid\": %d, \"tid\": %d, \"ts\": %.3f%s}",
+	    pid, pid, event.nanoseconds / 1e3,
+	    event.phase == 'i' ? ", \"s\": \"p\"" : "");
+  }
+  fprintf(out, "\n]}\n");
+  if (fclose(out)) {
+    fprintf(stderr, "trace-startup: write %s: %s\n", file, strerror(errno));
+  }
+}
@@ -0,0 +1,55 @@
+#ifndef SANDBOX_TRACE_H
+#define SANDBOX_TRACE_H
+
+
+/*
+  Copyright (c) 2012 Rohan McGovern <rohan@mcgovern.id.au>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+  LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+  Startup phase tracing (--trace-startup).
+
+  Events are timestamped with CLOCK_MONOTONIC and appended to a buffer in
+  shared memory, so the parent, FUSE and sandboxed processes created after
+  trace_start() all record into the same timeline. Each call is a no-op
+  unless tracing was started.
+*/
+
+/* allocate the event buffer; call before any process is created */
+void trace_start();
+
+/* name the calling process in events it records */
+void trace_process(const char* name);
+
+/* mark the start and end of a phase, or a single point in time */
+void trace_begin(const char* name);
+void trace_end(const char* name);
+void trace_instant(const char* name);
+
+/*
+  Print the timeline to stderr or, if file is non-empty, write it to file
+  in the Chrome trace event format (loadable in chrome://tracing or
+  Perfetto).
+*/
+void trace_report(const char* file);
+
+#endif
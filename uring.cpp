@@ -0,0 +1,308 @@
+/*
+  Copyright (c) 2012 Rohan McGovern <rohan@mcgovern.id.au>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+  LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include "uring.h"
+
+/* lstat() without io_uring, for a single entry */
+static int plain_lstat(int dirfd, const char* name, struct stat* st)
+{
+  if (fstatat(dirfd, name, st, AT_SYMLINK_NOFOLLOW)) {
+    return -errno;
+  }
+  return 0;
+}
+
+#ifdef __has_include
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+/* IORING_OP_STATX arrived with this flag, in Linux 5.6 */
+#ifdef IORING_FEAT_RW_CUR_POS
+#define SANDBOX_HAVE_IO_URING 1
+#endif
+#endif
+#endif
+
+#ifdef SANDBOX_HAVE_IO_URING
+
+#include <atomic>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+namespace {
+
+/* a thread's ring; only the parts used for submitting and reaping */
+class Ring {
+ public:
+  Ring();
+  ~Ring();
+  bool ok() const { return _fd != -1 && !_failed; }
+  /* returns false, falling back to fstatat(), if the ring has failed */
+  bool lstat(int dirfd, const char* const* names, size_t count,
+	     struct stat* st, int* results);
+
+ private:
+  int _fd;
+  bool _failed;
+  void* _sq_ring;
+  void* _cq_ring;
+  size_t _sq_size;
+  size_t _cq_size;
+  struct io_uring_sqe* _sqes;
+  size_t _sqes_size;
+  unsigned* _sq_tail;
+  unsigned _sq_mask;
+  unsigned* _sq_array;
+  unsigned* _cq_head;
+  unsigned* _cq_tail;
+  unsigned _cq_mask;
+  struct io_uring_cqe* _cqes;
+
+  /*
+    What the kernel reads and writes for a batch. Kept here rather than on
+    the stack, since after a failure requests may still be in flight, and
+    the ring is then never freed.
+  */
+  struct statx _stx[URING_BATCH];
+  char _names[URING_BATCH][NAME_MAX + 1];
+};
+
+/* set once the kernel's io_uring turns out not to support statx() */
+std::atomic<bool> statx_unsupported(false);
+
+Ring::Ring()
+  : _fd(-1), _failed(false), _sq_ring(MAP_FAILED), _cq_ring(MAP_FAILED), _sqes(0)
+{
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int fd = syscall(__NR_io_uring_setup, URING_BATCH, &params);
+  if (fd == -1) {
+    return;
+  }
+
+  _sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  _cq_size = params.cq_off.cqes
+    + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    _sq_size = _cq_size = _sq_size > _cq_size ? _sq_size : _cq_size;
+  }
+  _sq_ring = mmap(0, _sq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+		  fd, IORING_OFF_SQ_RING);
+  if (_sq_ring == MAP_FAILED) {
+    close(fd);
+    return;
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    _cq_ring = _sq_ring;
+  } else {
+    _cq_ring = mmap(0, _cq_size, PROT_READ|PROT_WRITE,
+		    MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (_cq_ring == MAP_FAILED) {
+      munmap(_sq_ring, _sq_size);
+      close(fd);
+      return;
+    }
+  }
+  _sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  void* sqes = mmap(0, _sqes_size, PROT_READ|PROT_WRITE,
+		    MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    if (_cq_ring != _sq_ring) {
+      munmap(_cq_ring, _cq_size);
+    }
+    munmap(_sq_ring, _sq_size);
+    close(fd);
+    return;
+  }
+  _sqes = (struct io_uring_sqe*)sqes;
+
+  char* sq = (char*)_sq_ring;
+  _sq_tail = (unsigned*)(sq + params.sq_off.tail);
+  _sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+  _sq_array = (unsigned*)(sq + params.sq_off.array);
+  char* cq = (char*)_cq_ring;
+  _cq_head = (unsigned*)(cq + params.cq_off.head);
+  _cq_tail = (unsigned*)(cq + params.cq_off.tail);
+  _cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+  _cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+  _fd = fd;
+}
+
+Ring::~Ring()
+{
+  /* after a failure, requests may still be in flight, so keep the rings */
+  if (_fd == -1 || _failed) {
+    return;
+  }
+  munmap(_sqes, _sqes_size);
+  if (_cq_ring != _sq_ring) {
+    munmap(_cq_ring, _cq_size);
+  }
+  munmap(_sq_ring, _sq_size);
+  close(_fd);
+}
+
+void statx_to_stat(const struct statx& stx, struct stat* st)
+{
+  memset(st, 0, sizeof(*st));
+  st->st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+  st->st_ino = stx.stx_ino;
+  st->st_mode = stx.stx_mode;
+  st->st_nlink = stx.stx_nlink;
+  st->st_uid = stx.stx_uid;
+  st->st_gid = stx.stx_gid;
+  st->st_rdev = makedev(stx.stx_rdev_major, stx.stx_rdev_minor);
+  st->st_size = stx.stx_size;
+  st->st_blksize = stx.stx_blksize;
+  st->st_blocks = stx.stx_blocks;
+  st->st_atim.tv_sec = stx.stx_atime.tv_sec;
+  st->st_atim.tv_nsec = stx.stx_atime.tv_nsec;
+  st->st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+  st->st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+  st->st_ctim.tv_sec = stx.stx_ctime.tv_sec;
+  st->st_ctim.tv_nsec = stx.stx_ctime.tv_nsec;
+}
+
+bool Ring::lstat(int dirfd, const char* const* names, size_t count,
+		 struct stat* st, int* results)
+{
+  /* the ring is only used by this thread, and is empty between batches */
+  unsigned tail = *_sq_tail;
+  size_t queued = 0;
+  for (size_t i = 0; i < count; ++i) {
+    size_t length = strlen(names[i]);
+    if (length > NAME_MAX) {
+      /* not a single name; stat'ed directly below */
+      results[i] = -ENAMETOOLONG;
+      continue;
+    }
+    memcpy(_names[i], names[i], length + 1);
+
+    unsigned index = (tail + queued) & _sq_mask;
+    struct io_uring_sqe* sqe = &_sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = dirfd;
+    sqe->addr = (uintptr_t)_names[i];
+    sqe->len = STATX_BASIC_STATS;
+    sqe->off = (uintptr_t)&_stx[i];
+    sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+    sqe->user_data = i;
+    _sq_array[index] = index;
+    results[i] = -EINVAL;
+    ++queued;
+  }
+  __atomic_store_n(_sq_tail, tail + queued, __ATOMIC_RELEASE);
+
+  size_t submitted = 0;
+  size_t done = 0;
+  while (done < queued) {
+    int entered = syscall(__NR_io_uring_enter, _fd, queued - submitted,
+			  queued - done, IORING_ENTER_GETEVENTS, 0, 0);
+    if (entered > 0) {
+      submitted += entered;
+    } else if (entered == -1 && errno != EINTR
+	       && !(submitted > done && (errno == EAGAIN || errno == EBUSY))) {
+      _failed = true;
+      break;
+    }
+    unsigned head = *_cq_head;
+    unsigned cq_tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != cq_tail; ++head, ++done) {
+      struct io_uring_cqe* cqe = &_cqes[head & _cq_mask];
+      results[cqe->user_data] = cqe->res;
+    }
+    __atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+  }
+
+  for (size_t i = 0; i < count; ++i) {
+    if (!results[i]) {
+      statx_to_stat(_stx[i], &st[i]);
+    } else if (results[i] == -ENAMETOOLONG) {
+      results[i] = plain_lstat(dirfd, names[i], &st[i]);
+    } else if (results[i] == -EINVAL) {
+      /* not completed, or IORING_OP_STATX unsupported (before Linux 5.6) */
+      if (!_failed) {
+	statx_unsupported = true;
+      }
+      results[i] = plain_lstat(dirfd, names[i], &st[i]);
+    }
+  }
+  return !_failed;
+}
+
+thread_local Ring* ring = 0;
+
+/* destroys the thread's ring when the thread exits */
+thread_local struct RingOwner {
+  ~RingOwner() { delete ring; }
+} ring_owner;
+
+}
+
+bool uring_available()
+{
+  Ring test;
+  return test.ok();
+}
+
+void uring_lstat(int dirfd, const char* const* names, size_t count,
+		 struct stat* st, int* results)
+{
+  if (!ring && !statx_unsupported) {
+    (void)&ring_owner;
+    ring = new Ring();
+  }
+  if (!statx_unsupported && ring->ok()) {
+    ring->lstat(dirfd, names, count, st, results);
+    return;
+  }
+  for (size_t i = 0; i < count; ++i) {
+    results[i] = plain_lstat(dirfd, names[i], &st[i]);
+  }
+}
+
+#else
+
+bool uring_available()
+{
+  return false;
+}
+
+void uring_lstat(int dirfd, const char* const* names, size_t count,
+		 struct stat* st, int* results)
+{
+  for (size_t i = 0; i < count; ++i) {
+    results[i] = plain_lstat(dirfd, names[i], &st[i]);
+  }
+}
+
+#endif
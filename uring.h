@@ -0,0 +1,54 @@
+#ifndef SANDBOX_URING_H
+#define SANDBOX_URING_H
+
+
+/*
+  Copyright (c) 2012 Rohan McGovern <rohan@mcgovern.id.au>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+  LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+/*
+  Batched system calls through io_uring for the FUSE process (--fs-uring).
+
+  Each thread has its own small ring, set up on first use, so that a batch
+  of calls costs a single io_uring_enter() rather than one system call
+  each. Built without io_uring support if the kernel headers lack it.
+*/
+
+/* maximum number of calls in one batch */
+#define URING_BATCH 32
+
+/* true if io_uring can be used on this system */
+bool uring_available();
+
+/*
+  lstat() each of names[0..count), relative to dirfd, in one batch; count
+  is at most URING_BATCH. Sets results[i] to 0 with st[i] filled, or to a
+  negative errno. Entries the kernel can't stat through io_uring are
+  stat'ed directly.
+*/
+void uring_lstat(int dirfd, const char* const* names, size_t count,
+		 struct stat* st, int* results);
+
+#endif